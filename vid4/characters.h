@@ -0,0 +1,235 @@
+#ifndef CHARACTERS_H
+#define CHARACTERS_H
+
+#include <vector>
+#include <algorithm>
+#include <climits>
+
+#include "common.h"
+#include "path.h"
+#include "slotmap.h"
+#include "spatial.h"
+
+
+// Simulation state of every character, one row each, in parallel arrays:
+// what Update() reads every tick (position, speed, last move, whether
+// moving) is packed tightly, and paths, which only characters that are due
+// a step touch, sit in their own array. Character is a handle to a row.
+//
+// Rows are dense; removing one moves the last row into its place, so refer
+// to rows by the handle Add() returned, never by row number.
+//
+// Given a SpatialGrid, rows that have been named an entity with
+// SetEntity() are kept filed in it as they move.
+class CharacterStore
+{
+public:
+    enum { DEFAULT_SPEED = 125, DEFAULT_HP = 100 };
+
+    CharacterStore(SpatialGrid* spatial = NULL)
+        : spatial(spatial)
+    { }
+
+    SlotHandle Add()
+    {
+        SlotHandle ret = rows.Insert(owners.size());
+
+        owners.push_back(ret);
+        loc_x.push_back(0);
+        loc_y.push_back(0);
+        speed.push_back(DEFAULT_SPEED);
+        last_move.push_back(0);
+        hp.push_back(DEFAULT_HP);
+        moving.push_back(0);
+        paths.push_back(PathWalker());
+        entities.push_back(SlotHandle());
+
+        return ret;
+    }
+
+    void Remove(SlotHandle handle)
+    {
+        unsigned int* row = rows.Get(handle);
+        if (!row)
+            return;
+
+        unsigned int gap = *row;
+        unsigned int last = owners.size() - 1;
+
+        if (spatial)
+            spatial->Remove(entities[gap]);
+
+        if (gap != last)
+        {
+            owners[gap] = owners[last];
+            loc_x[gap] = loc_x[last];
+            loc_y[gap] = loc_y[last];
+            speed[gap] = speed[last];
+            last_move[gap] = last_move[last];
+            hp[gap] = hp[last];
+            moving[gap] = moving[last];
+            std::swap(paths[gap], paths[last]);
+            entities[gap] = entities[last];
+
+            *rows.Get(owners[gap]) = gap;
+        }
+
+        owners.pop_back();
+        loc_x.pop_back();
+        loc_y.pop_back();
+        speed.pop_back();
+        last_move.pop_back();
+        hp.pop_back();
+        moving.pop_back();
+        paths.pop_back();
+        entities.pop_back();
+
+        rows.Erase(handle);
+    }
+
+    // Row of a handle Add() returned and Remove() has not been given.
+    inline unsigned int GetRow(SlotHandle handle) const
+    {
+        return *rows.Get(handle);
+    }
+
+    inline Point GetLoc(unsigned int row) const
+    {
+        return Point(loc_x[row], loc_y[row]);
+    }
+    inline void SetLoc(unsigned int row, Point loc)
+    {
+        loc_x[row] = loc.x;
+        loc_y[row] = loc.y;
+
+        if (spatial)
+            spatial->Move(entities[row], loc);
+    }
+
+    // Files the row in the grid under handle, or takes it out for a null
+    // one.
+    void SetEntity(unsigned int row, SlotHandle handle)
+    {
+        if (spatial)
+        {
+            spatial->Remove(entities[row]);
+            spatial->Insert(handle, GetLoc(row));
+        }
+
+        entities[row] = handle;
+    }
+
+    inline unsigned int GetSpeed(unsigned int row) const { return speed[row]; }
+    inline void SetSpeed(unsigned int row, unsigned int val)
+        { speed[row] = val; }
+
+    inline unsigned int GetHP(unsigned int row) const { return hp[row]; }
+    inline void SetHP(unsigned int row, unsigned int val) { hp[row] = val; }
+
+    inline unsigned int GetLastMove(unsigned int row) const
+        { return last_move[row]; }
+
+    inline bool IsMoving(unsigned int row) const { return moving[row]; }
+    inline PathWalker const& GetPath(unsigned int row) const
+        { return paths[row]; }
+
+    void ClearPath(unsigned int row)
+    {
+        paths[row].Clear();
+        moving[row] = 0;
+    }
+
+    // Appends a tile to the path; the first step of a new path waits a
+    // full step from now.
+    bool QueuePath(unsigned int row, Point tile, unsigned int now)
+    {
+        if (!moving[row])
+            last_move[row] = now;
+
+        if (!paths[row].Append(tile))
+            return false;
+
+        moving[row] = 1;
+        return true;
+    }
+
+    void SetPath(unsigned int row, const Path& path, unsigned int now)
+    {
+        ClearPath(row);
+
+        if (path.IsEmpty())
+            return;
+
+        paths[row].Set(path);
+        last_move[row] = now;
+        moving[row] = 1;
+    }
+
+    // Moves every character that is due one or more steps by now. However
+    // long since the last update, each character costs the same: its steps
+    // owed are worked out at once and taken a leg at a time, never a tile
+    // at a time. A speed of 0 walks the rest of the path in one go.
+    void Update(unsigned int now)
+    {
+        const size_t count = owners.size();
+        due.resize(count);
+
+        // A straight, branch-free pass over the hot arrays that the
+        // compiler can vectorise. Most characters owe nothing and drop out
+        // here without their path being touched.
+        for (size_t i = 0; i < count; i++)
+            due[i] = moving[i] & (now - last_move[i] > speed[i]);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!due[i])
+                continue;
+
+            unsigned int delta = now - last_move[i];
+            unsigned int steps = UINT_MAX;
+            unsigned int remainder = 0;
+
+            if (speed[i])
+            {
+                steps = delta / speed[i];
+                remainder = delta % speed[i];
+            }
+
+            PathWalker& path = paths[i];
+
+            Point at = path.Skip(steps);
+            loc_x[i] = at.x;
+            loc_y[i] = at.y;
+
+            if (spatial)
+                spatial->Move(entities[i], at);
+
+            last_move[i] = now - remainder;
+            moving[i] = !path.IsDone();
+        }
+    }
+
+    inline size_t GetCount() const { return owners.size(); }
+private:
+    SlotMap<unsigned int> rows;
+    std::vector<SlotHandle> owners;
+
+    // Hot: read every tick.
+    std::vector<int> loc_x;
+    std::vector<int> loc_y;
+    std::vector<unsigned int> speed;
+    std::vector<unsigned int> last_move;
+    std::vector<unsigned char> moving;
+
+    // Warm: only read and written through Character.
+    std::vector<unsigned int> hp;
+
+    // Cold: only touched by characters that are due a step.
+    std::vector<PathWalker> paths;
+    std::vector<SlotHandle> entities;
+
+    SpatialGrid* spatial;
+    std::vector<unsigned char> due;
+};
+
+#endif
@@ -0,0 +1,498 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "comm.h"
+
+
+// Appends wire primitives to a caller-owned buffer. Unsigned integers are
+// LEB128 varints, signed integers are zigzagged first and strings are
+// length-prefixed.
+class WireWriter
+{
+public:
+    WireWriter(std::vector<unsigned char>& out) : out(out) {}
+
+    inline void PutByte(unsigned char value) { out.push_back(value); }
+
+    void PutVarint(unsigned int value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back((unsigned char)(value | 0x80));
+            value >>= 7;
+        }
+
+        out.push_back((unsigned char)value);
+    }
+
+    inline void PutSigned(int value)
+    {
+        PutVarint(((unsigned int)value << 1) ^ (unsigned int)(value >> 31));
+    }
+
+    inline void PutPoint(const Point& value)
+    {
+        PutSigned(value.x);
+        PutSigned(value.y);
+    }
+
+    void PutString(const std::string& value)
+    {
+        PutVarint(value.size());
+        out.insert(out.end(), value.begin(), value.end());
+    }
+private:
+    std::vector<unsigned char>& out;
+};
+
+
+// Reads wire primitives straight out of a contiguous buffer. Running off the
+// end or reading a varint that is too long or does not fit in 32 bits
+// throws.
+class WireReader
+{
+public:
+    WireReader(const unsigned char* data, size_t size)
+        : start(data),
+          pos(data),
+          end(data + size)
+    { }
+
+    inline unsigned char GetByte()
+    {
+        if (pos == end)
+            throw std::runtime_error("Truncated message.");
+
+        return *pos++;
+    }
+
+    unsigned int GetVarint()
+    {
+        unsigned int ret = 0;
+
+        for (unsigned int shift = 0; shift < 35; shift += 7)
+        {
+            unsigned char b = GetByte();
+
+            // The fifth byte only has room for the top four bits.
+            if (shift == 28 && b > 0x0f)
+                break;
+
+            ret |= (unsigned int)(b & 0x7f) << shift;
+
+            if (!(b & 0x80))
+                return ret;
+        }
+
+        throw std::runtime_error("Malformed varint.");
+    }
+
+    inline int GetSigned()
+    {
+        unsigned int v = GetVarint();
+        return (int)(v >> 1) ^ -(int)(v & 1);
+    }
+
+    inline Point GetPoint()
+    {
+        Point ret;
+        ret.x = GetSigned();
+        ret.y = GetSigned();
+        return ret;
+    }
+
+    void GetString(std::string& value)
+    {
+        unsigned int length = GetVarint();
+
+        if ((size_t)(end - pos) < length)
+            throw std::runtime_error("Truncated message.");
+
+        value.assign((const char*)pos, length);
+        pos += length;
+    }
+
+    void Skip(size_t count)
+    {
+        if ((size_t)(end - pos) < count)
+            throw std::runtime_error("Truncated message.");
+
+        pos += count;
+    }
+
+    inline size_t GetConsumed() const { return pos - start; }
+    inline size_t GetRemaining() const { return end - pos; }
+private:
+    const unsigned char* start;
+    const unsigned char* pos;
+    const unsigned char* end;
+};
+
+
+// Binary form of the Message classes in comm.h. See notes for the layout.
+// Decoded messages come from their MessagePool and are owned by the caller.
+class MessageCodec
+{
+public:
+    // Longest frame body EncodeFrame writes or DecodeFrame waits for.
+    static const unsigned int MAX_FRAME_LENGTH = 1 << 20;
+
+    static void Encode(Message& message, std::vector<unsigned char>& out)
+    {
+        WireWriter w(out);
+
+        w.PutByte(message.GetType());
+
+        switch (message.GetType())
+        {
+        case MSG_ENTITY_APPEAR:
+            EncodeAppear(static_cast<EntityAppearMessage&>(message), w);
+            break;
+        case MSG_IDENTITY:
+        {
+            IdentityMessage& m = static_cast<IdentityMessage&>(message);
+            EncodeAppear(m, w);
+            w.PutString(m.map);
+            break;
+        }
+        case MSG_ENTITY_DISAPPEAR:
+            w.PutVarint(static_cast<EntityMessage&>(message).entity_id);
+            break;
+        case MSG_ENTITY_MOVE:
+        {
+            EntityMoveMessage& m = static_cast<EntityMoveMessage&>(message);
+
+            w.PutVarint(m.entity_id);
+            w.PutVarint(m.speed);
+            EncodePath(m.path, w);
+            break;
+        }
+        case MSG_ENTITY_ACTION:
+        {
+            EntityActionMessage& m =
+                static_cast<EntityActionMessage&>(message);
+
+            w.PutVarint(m.entity_id);
+            w.PutVarint(m.action_id);
+            w.PutVarint(m.skill_id);
+            w.PutPoint(m.action_loc);
+            w.PutVarint(m.affected.size());
+
+            for (auto& a : m.affected)
+            {
+                w.PutVarint(a.entity_id);
+                w.PutSigned(a.hp);
+            }
+            break;
+        }
+        case MSG_ENTITY_DELTA:
+            EncodeDelta(static_cast<EntityDeltaMessage&>(message), w);
+            break;
+        case MSG_SNAPSHOT_ACK:
+            w.PutVarint(static_cast<SnapshotAckMessage&>(message).sequence);
+            break;
+        default:
+            throw std::runtime_error("Unknown message type.");
+        }
+    }
+
+    // Reads one message from the front of data. consumed is set to the
+    // number of bytes it occupied.
+    static Message* Decode(const unsigned char* data, size_t size,
+                           size_t& consumed)
+    {
+        WireReader r(data, size);
+        Message* ret = NULL;
+
+        try
+        {
+            switch (r.GetByte())
+            {
+            case MSG_ENTITY_APPEAR:
+            {
+                EntityAppearMessage* m =
+                    MessagePool<EntityAppearMessage>::Acquire();
+                ret = m;
+                DecodeAppear(*m, r);
+                break;
+            }
+            case MSG_IDENTITY:
+            {
+                IdentityMessage* m = MessagePool<IdentityMessage>::Acquire();
+                ret = m;
+                DecodeAppear(*m, r);
+                r.GetString(m->map);
+                break;
+            }
+            case MSG_ENTITY_DISAPPEAR:
+            {
+                EntityDisappearMessage* m =
+                    MessagePool<EntityDisappearMessage>::Acquire();
+                ret = m;
+                m->entity_id = r.GetVarint();
+                break;
+            }
+            case MSG_ENTITY_MOVE:
+            {
+                EntityMoveMessage* m =
+                    MessagePool<EntityMoveMessage>::Acquire();
+                ret = m;
+
+                m->entity_id = r.GetVarint();
+                m->speed = r.GetVarint();
+                DecodePath(m->path, r);
+                break;
+            }
+            case MSG_ENTITY_ACTION:
+            {
+                EntityActionMessage* m =
+                    MessagePool<EntityActionMessage>::Acquire();
+                ret = m;
+
+                m->entity_id = r.GetVarint();
+                m->action_id = r.GetVarint();
+                m->skill_id = r.GetVarint();
+                m->action_loc = r.GetPoint();
+
+                unsigned int count = r.GetVarint();
+
+                if (count > r.GetRemaining() / 2)
+                    throw std::runtime_error("Truncated message.");
+
+                m->affected.resize(count);
+
+                for (auto& a : m->affected)
+                {
+                    a.entity_id = r.GetVarint();
+                    a.hp = r.GetSigned();
+                }
+                break;
+            }
+            case MSG_ENTITY_DELTA:
+            {
+                EntityDeltaMessage* m =
+                    MessagePool<EntityDeltaMessage>::Acquire();
+                ret = m;
+                DecodeDelta(*m, r);
+                break;
+            }
+            case MSG_SNAPSHOT_ACK:
+            {
+                SnapshotAckMessage* m =
+                    MessagePool<SnapshotAckMessage>::Acquire();
+                ret = m;
+                m->sequence = r.GetVarint();
+                break;
+            }
+            default:
+                throw std::runtime_error("Unknown message type.");
+            }
+        }
+        catch (...)
+        {
+            if (ret)
+                ret->Release();
+            throw;
+        }
+
+        consumed = r.GetConsumed();
+        return ret;
+    }
+
+    // Stream framing: a varint byte length followed by an encoded message.
+    static void EncodeFrame(Message& message, std::vector<unsigned char>& out)
+    {
+        size_t header = out.size();
+
+        // Reserve the common one-byte length and widen it if needed.
+        out.push_back(0);
+        Encode(message, out);
+
+        size_t length = out.size() - header - 1;
+
+        if (length > MAX_FRAME_LENGTH)
+        {
+            out.resize(header);
+            throw std::runtime_error("Message too large for a frame.");
+        }
+
+        if (length < 0x80)
+        {
+            out[header] = (unsigned char)length;
+            return;
+        }
+
+        std::vector<unsigned char> prefix;
+        WireWriter(prefix).PutVarint(length);
+
+        out[header] = prefix[0];
+        out.insert(out.begin() + header + 1, prefix.begin() + 1,
+                   prefix.end());
+    }
+
+    // Returns NULL, leaving consumed at 0, if data does not yet hold a
+    // complete frame. A length over MAX_FRAME_LENGTH throws as soon as it
+    // has been read, so a reader never buffers more than that for a frame.
+    static Message* DecodeFrame(const unsigned char* data, size_t size,
+                                size_t& consumed)
+    {
+        consumed = 0;
+
+        unsigned int length = 0;
+        size_t header = 0;
+
+        for (unsigned int shift = 0; ; shift += 7)
+        {
+            if (header == size)
+                return NULL;
+
+            unsigned char b = data[header++];
+
+            if (shift == 28 && b > 0x0f)
+                throw std::runtime_error("Malformed frame length.");
+
+            length |= (unsigned int)(b & 0x7f) << shift;
+
+            if (!(b & 0x80))
+                break;
+        }
+
+        if (length > MAX_FRAME_LENGTH)
+            throw std::runtime_error("Frame too long.");
+
+        if (size - header < length)
+            return NULL;
+
+        size_t used;
+        Message* ret = Decode(data + header, length, used);
+
+        if (used != length)
+        {
+            ret->Release();
+            throw std::runtime_error("Frame length mismatch.");
+        }
+
+        consumed = header + length;
+        return ret;
+    }
+private:
+    static void EncodeAppear(EntityAppearMessage& m, WireWriter& w)
+    {
+        w.PutVarint(m.entity_id);
+        w.PutString(m.name);
+        w.PutString(m.skin);
+        w.PutPoint(m.loc);
+    }
+
+    static void DecodeAppear(EntityAppearMessage& m, WireReader& r)
+    {
+        m.entity_id = r.GetVarint();
+        r.GetString(m.name);
+        r.GetString(m.skin);
+        m.loc = r.GetPoint();
+    }
+
+    // The start, then each leg as a direction byte and a tile count. A
+    // count of 0 means no path; otherwise it is the number of legs + 1.
+    static void EncodePath(const Path& path, WireWriter& w)
+    {
+        if (path.IsEmpty())
+        {
+            w.PutVarint(0);
+            return;
+        }
+
+        w.PutVarint(path.GetLegs().size() + 1);
+        w.PutPoint(path.GetStart());
+
+        for (auto& l : path.GetLegs())
+        {
+            w.PutByte(l.direction);
+            w.PutVarint(l.tiles);
+        }
+    }
+
+    static void DecodePath(Path& path, WireReader& r)
+    {
+        path.Clear();
+
+        unsigned int count = r.GetVarint();
+        if (!count)
+            return;
+
+        // Each leg takes at least two bytes.
+        if (count - 1 > r.GetRemaining() / 2)
+            throw std::runtime_error("Truncated message.");
+
+        path.Append(r.GetPoint());
+
+        for (unsigned int i = 1; i < count; i++)
+        {
+            unsigned char direction = r.GetByte();
+            unsigned int tiles = r.GetVarint();
+
+            if (direction >= DIR_COUNT || !tiles)
+                throw std::runtime_error("Malformed path leg.");
+
+            path.AppendLeg(direction, tiles);
+        }
+    }
+
+    // Only flagged fields are written, in bit order. The baseline goes out
+    // as its distance back from sequence, which is almost always small.
+    static void EncodeDelta(EntityDeltaMessage& m, WireWriter& w)
+    {
+        w.PutVarint(m.entity_id);
+        w.PutVarint(m.sequence);
+        w.PutVarint(m.baseline ? m.sequence - m.baseline : 0);
+        w.PutByte(m.fields);
+
+        if (m.fields & FIELD_LOC)
+            w.PutPoint(m.state.loc);
+        if (m.fields & FIELD_SPEED)
+            w.PutVarint(m.state.speed);
+        if (m.fields & FIELD_HP)
+            w.PutSigned(m.state.hp);
+        if (m.fields & FIELD_PATH)
+            EncodePath(m.state.path, w);
+        if (m.fields & FIELD_NAME)
+            w.PutString(m.state.name);
+        if (m.fields & FIELD_SKIN)
+            w.PutString(m.state.skin);
+    }
+
+    static void DecodeDelta(EntityDeltaMessage& m, WireReader& r)
+    {
+        m.entity_id = r.GetVarint();
+        m.sequence = r.GetVarint();
+
+        unsigned int back = r.GetVarint();
+        if (back > m.sequence)
+            throw std::runtime_error("Malformed snapshot baseline.");
+
+        m.baseline = back ? m.sequence - back : 0;
+        m.fields = r.GetByte();
+
+        if (m.fields & ~FIELD_ALL)
+            throw std::runtime_error("Unknown snapshot field.");
+
+        if (m.fields & FIELD_LOC)
+            m.state.loc = r.GetPoint();
+        if (m.fields & FIELD_SPEED)
+            m.state.speed = r.GetVarint();
+        if (m.fields & FIELD_HP)
+            m.state.hp = r.GetSigned();
+        if (m.fields & FIELD_PATH)
+            DecodePath(m.state.path, r);
+        if (m.fields & FIELD_NAME)
+            r.GetString(m.state.name);
+        if (m.fields & FIELD_SKIN)
+            r.GetString(m.state.skin);
+    }
+};
+
+#endif
@@ -1,136 +1,1222 @@
 #ifndef COMM_H
 #define COMM_H
 
-#include <map>
-#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iterator>
 #include <stdexcept>
+#include <unordered_map>
+#include <vector>
 
 #include <boost/thread/mutex.hpp>
 #include <boost/thread.hpp>
 
 #include "common.h"
+#include "path.h"
 
 
 enum COMM_ADDRESSES {
     ADDR_UPLINK,
-    ADDR_GAME_ENGINE
+    ADDR_GAME_ENGINE,
+    ADDR_LOGGER,
+
+    ADDR_COUNT
+};
+
+
+// Compact tag carried by every message so consumers can dispatch on it
+// without RTTI.
+enum MESSAGE_TYPE {
+    MSG_ENTITY_APPEAR,
+    MSG_IDENTITY,
+    MSG_ENTITY_DISAPPEAR,
+    MSG_ENTITY_MOVE,
+    MSG_ENTITY_ACTION,
+    MSG_ENTITY_DELTA,
+    MSG_SNAPSHOT_ACK,
+
+    MSG_TYPE_COUNT
+};
+
+
+// Points in a message's life that it is stamped at, see trace.h.
+enum TRACE_POINT {
+    TRACE_CREATED,
+    TRACE_DISPATCHED,
+
+    TRACE_POINT_COUNT
+};
+
+
+// Delivery classes, most urgent first; see MessageQueue.
+enum MESSAGE_LANE {
+    LANE_CONTROL,
+    LANE_ENTITY,
+
+    LANE_COUNT
+};
+
+
+enum ENTITY_ACTION_TYPE {
+    TARGET,
+    AOE
+};
+
+
+struct MessagePoolStats
+{
+    unsigned long live;
+    unsigned long allocated;
+    unsigned long recycled;
+};
+
+
+// Free lists for one Message subclass. Each thread keeps a small private
+// cache so Acquire/Release normally never lock; when a cache runs dry or
+// grows too large it trades a batch with a shared depot. That lets messages
+// created on one thread (a network or simulator thread) and released on
+// another (the client) find their way back to the producer.
+//
+// Released messages are Reset(), which keeps the capacity of their strings
+// and vectors, so a recycled message usually needs no allocation to refill.
+template <class T>
+class MessagePool
+{
+public:
+    static T* Acquire()
+    {
+        Depot& depot = GetDepot();
+        Cache& cache = GetCache();
+
+        if (cache.free.empty())
+            Refill(depot, cache);
+
+        T* ret;
+
+        if (cache.free.empty())
+        {
+            ret = new T();
+            depot.allocated.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            ret = cache.free.back();
+            cache.free.pop_back();
+            depot.recycled.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        depot.live.fetch_add(1, std::memory_order_relaxed);
+
+        if (T::IsTracing())
+            ret->StartTrace();
+        return ret;
+    }
+
+    static void Release(T* message)
+    {
+        Depot& depot = GetDepot();
+        Cache& cache = GetCache();
+
+        message->Reset();
+        cache.free.push_back(message);
+        depot.live.fetch_sub(1, std::memory_order_relaxed);
+
+        if (cache.free.size() >= CACHE_LIMIT)
+            Spill(depot, cache, CACHE_LIMIT / 2);
+    }
+
+    static MessagePoolStats GetStats()
+    {
+        Depot& depot = GetDepot();
+
+        MessagePoolStats ret;
+        ret.live = depot.live.load(std::memory_order_relaxed);
+        ret.allocated = depot.allocated.load(std::memory_order_relaxed);
+        ret.recycled = depot.recycled.load(std::memory_order_relaxed);
+        return ret;
+    }
+private:
+    enum { CACHE_LIMIT = 256, BATCH_SIZE = CACHE_LIMIT / 2 };
+
+    struct Depot
+    {
+        Depot() : live(0), allocated(0), recycled(0) {}
+
+        ~Depot()
+        {
+            for (auto& m : free)
+                delete m;
+        }
+
+        boost::mutex mutex;
+        std::vector<T*> free;
+
+        std::atomic<unsigned long> live;
+        std::atomic<unsigned long> allocated;
+        std::atomic<unsigned long> recycled;
+    };
+
+    struct Cache
+    {
+        ~Cache()
+        {
+            Spill(GetDepot(), *this, free.size());
+        }
+
+        std::vector<T*> free;
+    };
+
+    static Depot& GetDepot()
+    {
+        static Depot depot;
+        return depot;
+    }
+
+    static Cache& GetCache()
+    {
+        static thread_local Cache cache;
+        return cache;
+    }
+
+    static void Refill(Depot& depot, Cache& cache)
+    {
+        boost::mutex::scoped_lock lock(depot.mutex);
+
+        size_t count = std::min((size_t)BATCH_SIZE, depot.free.size());
+        cache.free.insert(cache.free.end(), depot.free.end() - count,
+                          depot.free.end());
+        depot.free.resize(depot.free.size() - count);
+    }
+
+    static void Spill(Depot& depot, Cache& cache, size_t count)
+    {
+        boost::mutex::scoped_lock lock(depot.mutex);
+
+        depot.free.insert(depot.free.end(), cache.free.end() - count,
+                          cache.free.end());
+        cache.free.resize(cache.free.size() - count);
+    }
 };
 
 
-enum ENTITY_ACTION_TYPE {
-    TARGET,
-    AOE
-};
+// Messages are created with MessagePool<T>::Acquire() and handed to
+// Endpoint::Send, which transfers ownership. Whoever finally consumes a
+// message calls Release() on it rather than deleting it.
+//
+// A message can have several owners at once (see Router::Subscribe): each
+// holds one reference, and the last Release() recycles it. A shared message
+// is read-only; only the holder of the sole reference may modify it.
+class Message
+{
+public:
+    Message(unsigned char type) : type(type), refs(1)
+    {
+        for (int i = 0; i < TRACE_POINT_COUNT; i++)
+            trace[i] = 0;
+    }
+
+    virtual ~Message() {}
+
+    virtual int GetDestination() = 0;
+
+    inline unsigned char GetType() const { return type; }
+
+    // Everything about an entity shares one lane, since lanes only keep
+    // order within themselves: a move handed over before the appear it
+    // follows, or after the disappear that follows it, would be lost.
+    inline int GetLane() const
+    {
+        switch (type)
+        {
+        case MSG_ENTITY_APPEAR:
+        case MSG_IDENTITY:
+        case MSG_ENTITY_DISAPPEAR:
+        case MSG_ENTITY_MOVE:
+        case MSG_ENTITY_ACTION:
+        case MSG_ENTITY_DELTA:
+            return LANE_ENTITY;
+        default:
+            return LANE_CONTROL;
+        }
+    }
+
+    inline void AddRef(unsigned int count = 1)
+    {
+        refs.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    inline void Release()
+    {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+
+        // Ready for whoever gets it out of the pool next.
+        refs.store(1, std::memory_order_relaxed);
+        Recycle();
+    }
+
+    inline bool IsShared() const
+    {
+        return refs.load(std::memory_order_acquire) > 1;
+    }
+
+    // Returns the message to its pool. Called by the last Release().
+    virtual void Recycle() { delete this; }
+
+    // Clears the payload ahead of reuse.
+    virtual void Reset() {}
+
+    // Timestamps (Time::GetMicros) taken on the way to the client; 0 if the
+    // message has not got that far, or tracing is off. Only set while the
+    // message is unshared.
+    inline void Stamp(int point, unsigned long long micros)
+    {
+        trace[point] = micros;
+    }
+    inline unsigned long long GetStamp(int point) const
+    {
+        return trace[point];
+    }
+
+    inline void StartTrace()
+    {
+        trace[TRACE_CREATED] = Time::GetMicros();
+
+        for (int i = TRACE_CREATED + 1; i < TRACE_POINT_COUNT; i++)
+            trace[i] = 0;
+    }
+
+    // Whether MessagePool and Router stamp messages at all. Turn it on
+    // before the first message is acquired; nothing clears old stamps.
+    static inline bool IsTracing()
+    {
+        return GetTracing().load(std::memory_order_relaxed);
+    }
+    static inline void SetTracing(bool on)
+    {
+        GetTracing().store(on, std::memory_order_relaxed);
+    }
+private:
+    static std::atomic<bool>& GetTracing()
+    {
+        static std::atomic<bool> tracing(false);
+        return tracing;
+    }
+
+    const unsigned char type;
+    std::atomic<unsigned int> refs;
+    unsigned long long trace[TRACE_POINT_COUNT];
+};
+
+
+class EntityMessage : public Message
+{
+public:
+    EntityMessage(unsigned char type) : Message(type) {}
+
+    unsigned int entity_id = 0;
+
+    virtual int GetDestination() { return ADDR_GAME_ENGINE; }
+
+    virtual void Reset() { entity_id = 0; }
+};
+
+
+class EntityAppearMessage : public EntityMessage
+{
+public:
+    EntityAppearMessage() : EntityMessage(MSG_ENTITY_APPEAR) {}
+
+    std::string name;
+    std::string skin;
+    Point loc;
+
+    virtual void Recycle() { MessagePool<EntityAppearMessage>::Release(this); }
+
+    virtual void Reset()
+    {
+        EntityMessage::Reset();
+        name.clear();
+        skin.clear();
+        loc = Point();
+    }
+protected:
+    EntityAppearMessage(unsigned char type) : EntityMessage(type) {}
+};
+
+
+class IdentityMessage : public EntityAppearMessage
+{
+public:
+    IdentityMessage() : EntityAppearMessage(MSG_IDENTITY) {}
+
+    std::string map;
+
+    virtual void Recycle() { MessagePool<IdentityMessage>::Release(this); }
+
+    virtual void Reset()
+    {
+        EntityAppearMessage::Reset();
+        map.clear();
+    }
+};
+
+
+class EntityDisappearMessage : public EntityMessage
+{
+public:
+    EntityDisappearMessage() : EntityMessage(MSG_ENTITY_DISAPPEAR) {}
+
+    virtual void Recycle()
+    {
+        MessagePool<EntityDisappearMessage>::Release(this);
+    }
+};
+
+
+// Payload vectors that grew past this many elements are freed rather than
+// kept around in the pool.
+#define MESSAGE_RETAINED_CAPACITY 256
+
+
+class EntityMoveMessage : public EntityMessage
+{
+public:
+    EntityMoveMessage() : EntityMessage(MSG_ENTITY_MOVE) {}
+
+    unsigned int speed = 0;
+    Path path;
+
+    virtual void Recycle() { MessagePool<EntityMoveMessage>::Release(this); }
+
+    virtual void Reset()
+    {
+        EntityMessage::Reset();
+        speed = 0;
+        path.Reset(MESSAGE_RETAINED_CAPACITY);
+    }
+};
+
+
+struct ActionAffectedDetails
+{
+    int entity_id;
+    int hp;
+};
+
+
+class EntityActionMessage : public EntityMessage
+{
+public:
+    EntityActionMessage() : EntityMessage(MSG_ENTITY_ACTION) {}
+
+    unsigned int action_id = 0;
+    unsigned int skill_id = 0;
+    Point action_loc;
+    std::vector<ActionAffectedDetails> affected;
+
+    virtual void Recycle() { MessagePool<EntityActionMessage>::Release(this); }
+
+    virtual void Reset()
+    {
+        EntityMessage::Reset();
+        action_id = 0;
+        skill_id = 0;
+        action_loc = Point();
+
+        if (affected.capacity() > MESSAGE_RETAINED_CAPACITY)
+            std::vector<ActionAffectedDetails>().swap(affected);
+        else
+            affected.clear();
+    }
+};
+
+
+// Fields of an EntityState, as flagged in EntityDeltaMessage::fields.
+enum ENTITY_STATE_FIELD {
+    FIELD_LOC = 1 << 0,
+    FIELD_SPEED = 1 << 1,
+    FIELD_HP = 1 << 2,
+    FIELD_PATH = 1 << 3,
+    FIELD_NAME = 1 << 4,
+    FIELD_SKIN = 1 << 5,
+
+    FIELD_ALL = (1 << 6) - 1
+};
+
+
+// Everything a client needs to show an entity. Snapshots replicate it field
+// by field, see snapshot.h.
+struct EntityState
+{
+    std::string name;
+    std::string skin;
+    Point loc;
+    unsigned int speed = 0;
+    int hp = 0;
+    Path path;
+};
+
+
+// The fields of one entity that changed between an acknowledged snapshot
+// (baseline) and this one (sequence). Fields not flagged are left as they
+// were in the baseline. A baseline of 0 means every field is present.
+class EntityDeltaMessage : public EntityMessage
+{
+public:
+    EntityDeltaMessage() : EntityMessage(MSG_ENTITY_DELTA) {}
+
+    unsigned int sequence = 0;
+    unsigned int baseline = 0;
+    unsigned char fields = 0;
+    EntityState state;
+
+    virtual void Recycle() { MessagePool<EntityDeltaMessage>::Release(this); }
+
+    virtual void Reset()
+    {
+        EntityMessage::Reset();
+        sequence = 0;
+        baseline = 0;
+        fields = 0;
+
+        state.name.clear();
+        state.skin.clear();
+        state.loc = Point();
+        state.speed = 0;
+        state.hp = 0;
+
+        state.path.Reset(MESSAGE_RETAINED_CAPACITY);
+    }
+};
+
+
+// Sent by the client once it has applied every snapshot up to and including
+// sequence. A sequence of 0 asks for a full snapshot instead.
+class SnapshotAckMessage : public Message
+{
+public:
+    SnapshotAckMessage() : Message(MSG_SNAPSHOT_ACK) {}
+
+    unsigned int sequence = 0;
+
+    virtual int GetDestination() { return ADDR_UPLINK; }
+
+    virtual void Recycle() { MessagePool<SnapshotAckMessage>::Release(this); }
+
+    virtual void Reset() { sequence = 0; }
+};
+
+
+#define CACHE_LINE_SIZE 64
+#define DRAIN_ALL ((size_t)-1)
+
+
+// Bounded lock-free ring for exactly one producer thread and one consumer
+// thread. head is only written by the consumer and tail only by the
+// producer; each side keeps a cached copy of the other's index so the shared
+// cache lines are only touched when the ring looks full or empty.
+template <class T>
+class SpscRing
+{
+public:
+    SpscRing(unsigned int capacity)
+        : head(0),
+          cached_tail(0),
+          tail(0),
+          cached_head(0)
+    {
+        unsigned int size = 1;
+        while (size < capacity)
+            size <<= 1;
+
+        mask = size - 1;
+        slots = new T[size];
+    }
+
+    ~SpscRing()
+    {
+        delete[] slots;
+    }
+
+    // Producer only.
+    bool try_push(const T& value)
+    {
+        const size_t t = tail.load(std::memory_order_relaxed);
+
+        if (t - cached_head > mask)
+        {
+            cached_head = head.load(std::memory_order_acquire);
+
+            if (t - cached_head > mask)
+                return false;
+        }
+
+        slots[t & mask] = value;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer only. Publishes as many of values as fit with a single
+    // release store and returns how many that was.
+    size_t try_push_many(const T* values, size_t count)
+    {
+        const size_t t = tail.load(std::memory_order_relaxed);
+
+        if (t + count - cached_head > mask + 1)
+            cached_head = head.load(std::memory_order_acquire);
+
+        size_t free = mask + 1 - (t - cached_head);
+        if (count > free)
+            count = free;
+
+        for (size_t i = 0; i < count; i++)
+            slots[(t + i) & mask] = values[i];
+
+        if (count > 0)
+            tail.store(t + count, std::memory_order_release);
+
+        return count;
+    }
+
+    // Consumer only.
+    bool try_pop(T& value)
+    {
+        const size_t h = head.load(std::memory_order_relaxed);
+
+        if (h == cached_tail)
+        {
+            cached_tail = tail.load(std::memory_order_acquire);
+
+            if (h == cached_tail)
+                return false;
+        }
+
+        value = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Appends up to max of the entries currently in the ring
+    // to out with a single acquire load and a single release store.
+    size_t drain_into(std::vector<T>& out, size_t max = DRAIN_ALL)
+    {
+        const size_t h = head.load(std::memory_order_relaxed);
+        cached_tail = tail.load(std::memory_order_acquire);
+
+        const size_t count = std::min(cached_tail - h, max);
+        if (count == 0)
+            return 0;
+
+        for (size_t i = h; i != h + count; i++)
+            out.push_back(slots[i & mask]);
+
+        head.store(h + count, std::memory_order_release);
+        return count;
+    }
+
+    // Approximate when called from anywhere but the consumer.
+    bool empty() const
+    {
+        return head.load(std::memory_order_acquire) ==
+               tail.load(std::memory_order_acquire);
+    }
+
+    // Approximate when called from anywhere but the consumer.
+    inline size_t size() const
+    {
+        return tail.load(std::memory_order_acquire) -
+               head.load(std::memory_order_acquire);
+    }
+
+    inline size_t capacity() const { return mask + 1; }
+private:
+    SpscRing(const SpscRing&);
+    SpscRing& operator=(const SpscRing&);
+
+    size_t mask;
+    T* slots;
+
+    char pad0[CACHE_LINE_SIZE];
+
+    // Consumer side
+    std::atomic<size_t> head;
+    size_t cached_tail;
+
+    char pad1[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+
+    // Producer side
+    std::atomic<size_t> tail;
+    size_t cached_head;
+
+    char pad2[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+};
+
+
+// What a bounded MessageQueue does with a message for a full lane.
+enum QUEUE_POLICY {
+    QUEUE_SPILL,        // Not bounded: keep spilling.
+    QUEUE_BLOCK,        // Wait for the consumer to make room.
+    QUEUE_DROP_NEWEST,  // Release the new message.
+    QUEUE_DROP_OLDEST,  // Release the oldest spilled message.
+    QUEUE_COALESCE      // Replace a spilled move for the same entity, or
+                        // failing that, release the oldest spilled message.
+};
+
+
+struct QueueOptions
+{
+    static const unsigned int DEFAULT_CAPACITY = 1024;
+
+    explicit QueueOptions(unsigned int capacity = DEFAULT_CAPACITY,
+                          QUEUE_POLICY policy = QUEUE_SPILL,
+                          unsigned int spill_limit = 0,
+                          bool stats = false)
+        : capacity(capacity),
+          policy(policy),
+          spill_limit(spill_limit),
+          stats(stats)
+    { }
+
+    // Ring slots per lane.
+    unsigned int capacity;
+
+    QUEUE_POLICY policy;
+
+    // How many messages a lane may spill past its ring before policy kicks
+    // in. Ignored by QUEUE_SPILL; at least 1 otherwise.
+    unsigned int spill_limit;
+
+    // Whether the consumer keeps the depth and wait figures of LaneStats.
+    // They cost it a few stores per message, and a clock read per drain;
+    // the producer's drops, coalesced and stalls are always kept.
+    bool stats;
+};
+
+
+struct LaneStats
+{
+    unsigned long depth;
+    unsigned long max_depth;
+    unsigned long messages;
+    unsigned long waited;       // Messages whose wait is in wait_total.
+    unsigned long wait_total;
+    unsigned long wait_max;
+
+    unsigned long drops;
+    unsigned long coalesced;
+    unsigned long stalls;
+};
+
+
+// Single-producer/single-consumer message queue. The fast path is the
+// lock-free ring; if the consumer falls behind far enough to fill it, the
+// producer spills into a mutex-guarded overflow queue and keeps spilling
+// until the consumer has caught up, so ordering is preserved and nothing is
+// dropped.
+//
+// Unless the policy is QUEUE_SPILL, the overflow is bounded and the lane can
+// hold at most its ring capacity plus the spill limit. The policy then
+// decides what gives when a lane is full. Only spilled messages are ever
+// dropped or replaced, never ones already in the ring, which the consumer
+// may be reading. QUEUE_BLOCK must not be used where the producer and
+// consumer are the same thread.
+//
+// A prioritized queue keeps one such ring per MESSAGE_LANE. Order is kept
+// within a lane, but the consumer is handed higher lanes first. With
+// QueueOptions::stats, it records per lane how deep the lane got and how
+// long messages waited in it, from their latest trace stamp (so only while
+// Message::IsTracing()) to being taken out. drain_into times every message
+// it takes; try_pop only times one pop in WAIT_SAMPLE, to keep the clock
+// off the single-message path.
+//
+// In blocking mode wait_and_pop() is available. The producer only touches
+// the mutex/condition variable when the consumer is actually asleep.
+class MessageQueue
+{
+public:
+    static const unsigned int DEFAULT_CAPACITY =
+        QueueOptions::DEFAULT_CAPACITY;
+
+    MessageQueue(unsigned int capacity = DEFAULT_CAPACITY,
+                 bool blocking = false,
+                 bool prioritized = false)
+        : MessageQueue(QueueOptions(capacity), blocking, prioritized)
+    { }
+
+    MessageQueue(const QueueOptions& options,
+                 bool blocking = false,
+                 bool prioritized = false)
+        : lane_count(prioritized ? LANE_COUNT : 1),
+          policy(options.policy),
+          spill_limit(std::max(options.spill_limit, 1u)),
+          stats(options.stats),
+          producer_waiting(false),
+          blocking(blocking),
+          waiting(false)
+    {
+        for (unsigned int i = 0; i < lane_count; i++)
+            lanes[i] = new Lane(options.capacity);
+    }
+
+    // Releases whatever was never taken out. Neither side may be using the
+    // queue any more.
+    virtual ~MessageQueue()
+    {
+        std::vector<Message*> left;
+
+        for (unsigned int i = 0; i < lane_count; i++)
+        {
+            lanes[i]->ring.drain_into(left);
+            left.insert(left.end(), lanes[i]->overflow.begin(),
+                        lanes[i]->overflow.end());
+
+            delete lanes[i];
+        }
+
+        for (auto& m : left)
+            m->Release();
+    }
+
+    // Producer only.
+    void push(Message* data)
+    {
+        Push(LaneOf(data), &data, 1);
+
+        if (blocking)
+            wake_consumer();
+    }
+
+    // Producer only.
+    void push_all(const std::vector<Message*>& data)
+    {
+        if (data.empty())
+            return;
+
+        // Runs of messages in the same lane go in together.
+        size_t start = 0;
+
+        while (start < data.size())
+        {
+            Lane& lane = LaneOf(data[start]);
+            size_t end = start + 1;
+
+            while (end < data.size() && &LaneOf(data[end]) == &lane)
+                end++;
+
+            Push(lane, &data[start], end - start);
+            start = end;
+        }
+
+        if (blocking)
+            wake_consumer();
+    }
+
+    bool empty() const
+    {
+        for (unsigned int i = 0; i < lane_count; i++)
+            if (!lanes[i]->ring.empty() ||
+                lanes[i]->spilled.load(std::memory_order_acquire) > 0)
+                return false;
+
+        return true;
+    }
+
+    // Consumer only.
+    Message* try_pop()
+    {
+        for (unsigned int i = 0; i < lane_count; i++)
+        {
+            Lane& lane = *lanes[i];
+            Message* ret;
+
+            // Measured before the pop, as drain_into does; a message pushed
+            // since still counts for itself.
+            size_t depth = 0;
+            if (stats)
+                depth = lane.ring.size() +
+                    lane.spilled.load(std::memory_order_acquire);
+
+            if (!lane.ring.try_pop(ret))
+            {
+                if (lane.spilled.load(std::memory_order_acquire) == 0)
+                    continue;
+
+                // Anything that made it into the ring before the spill is
+                // older than the overflow and is visible now, so check the
+                // ring again.
+                if (!lane.ring.try_pop(ret))
+                {
+                    boost::mutex::scoped_lock lock(the_mutex);
+                    ret = lane.overflow.front();
+                    lane.overflow.pop_front();
+                    lane.spilled.fetch_sub(1, std::memory_order_release);
+
+                    if (producer_waiting)
+                        space_available.notify_one();
+                }
+            }
+
+            if (stats)
+                Account(lane, &ret, 1, std::max(depth, (size_t)1),
+                        ++lane.pops % WAIT_SAMPLE == 0);
+            return ret;
+        }
+
+        return NULL;
+    }
+
+    // Consumer only. Hands over everything queued so far (or max messages),
+    // without taking the lock unless the queue has spilled. Lanes come out
+    // highest first and oldest first within a lane.
+    //
+    // With a budget, every waiting lane is first given a share of it (one
+    // STARVATION_SHARE-th, at least one message) so a flood in a higher
+    // lane cannot hold a lower one back forever; what is left of the budget
+    // then goes by priority.
+    size_t drain_into(std::vector<Message*>& out, size_t max = DRAIN_ALL)
+    {
+        size_t take[LANE_COUNT];
+        size_t depth[LANE_COUNT];
+
+        for (unsigned int i = 0; i < lane_count; i++)
+        {
+            depth[i] = lanes[i]->ring.size() +
+                lanes[i]->spilled.load(std::memory_order_acquire);
+            take[i] = max;
+        }
+
+        if (max != DRAIN_ALL && lane_count > 1)
+        {
+            size_t left = max;
+            size_t share = std::max((size_t)1, max / STARVATION_SHARE);
+
+            for (unsigned int i = 0; i < lane_count; i++)
+            {
+                take[i] = std::min(std::min(depth[i], share), left);
+                left -= take[i];
+            }
+
+            for (unsigned int i = 0; i < lane_count; i++)
+            {
+                size_t more = std::min(depth[i] - take[i], left);
+                take[i] += more;
+                left -= more;
+            }
+        }
 
+        size_t count = 0;
 
-class Message
-{
-public:
-    virtual ~Message() {}
+        for (unsigned int i = 0; i < lane_count && count < max; i++)
+        {
+            size_t start = out.size();
+            size_t taken = Drain(*lanes[i], out, std::min(take[i],
+                                                          max - count));
 
-    virtual int GetDestination() = 0;
-};
+            if (taken && stats)
+                Account(*lanes[i], &out[start], taken, depth[i], true);
 
+            count += taken;
+        }
 
-class EntityMessage : public Message
-{
-public:
-    unsigned int entity_id;
+        return count;
+    }
 
-    virtual int GetDestination() { return ADDR_GAME_ENGINE; }
-};
+    // Consumer only, blocking mode only.
+    Message* wait_and_pop()
+    {
+        if (!blocking)
+            throw std::runtime_error("MessageQueue is not in blocking mode.");
 
+        while (true)
+        {
+            if (Message* ret = try_pop())
+                return ret;
 
-class EntityAppearMessage : public EntityMessage
-{
-public:
-    std::string name;
-    std::string skin;
-    Point loc;
-};
+            boost::mutex::scoped_lock lock(the_mutex);
 
+            waiting.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
 
-class IdentityMessage : public EntityAppearMessage
-{
-public:
-    std::string map;
-};
+            if (!empty())
+            {
+                waiting.store(false);
+                continue;
+            }
 
+            the_condition_variable.wait(lock);
+            waiting.store(false);
+        }
+    }
 
-class EntityDisappearMessage : public EntityMessage {};
+    inline bool is_blocking() const { return blocking; }
 
+    // Approximate when called from anywhere but the consumer. lane is a
+    // MESSAGE_LANE; an unprioritized queue keeps everything in lane 0.
+    LaneStats lane_stats(int lane) const
+    {
+        LaneStats ret = LaneStats();
 
-class EntityMoveMessage : public EntityMessage
-{
-public:
-    unsigned int speed;
-    std::vector<Point> path;
-};
+        if (lane < 0 || (unsigned int)lane >= lane_count)
+            return ret;
 
+        const Lane& l = *lanes[lane];
 
-struct ActionAffectedDetails
-{
-    int entity_id;
-    int hp;
-};
+        ret.depth = l.ring.size() +
+            l.spilled.load(std::memory_order_relaxed);
+        ret.max_depth = l.max_depth.load(std::memory_order_relaxed);
+        ret.messages = l.messages.load(std::memory_order_relaxed);
+        ret.waited = l.waited.load(std::memory_order_relaxed);
+        ret.wait_total = l.wait_total.load(std::memory_order_relaxed);
+        ret.wait_max = l.wait_max.load(std::memory_order_relaxed);
+        ret.drops = l.drops.load(std::memory_order_relaxed);
+        ret.coalesced = l.coalesced.load(std::memory_order_relaxed);
+        ret.stalls = l.stalls.load(std::memory_order_relaxed);
+        return ret;
+    }
+private:
+    enum { STARVATION_SHARE = 8, WAIT_SAMPLE = 64 };
 
+    struct Lane
+    {
+        Lane(unsigned int capacity)
+            : ring(capacity),
+              spilled(0),
+              pops(0),
+              max_depth(0),
+              messages(0),
+              waited(0),
+              wait_total(0),
+              wait_max(0),
+              drops(0),
+              coalesced(0),
+              stalls(0)
+        { }
 
-class EntityActionMessage : public EntityMessage
-{
-public:
-    unsigned int action_id;
-    unsigned int skill_id;
-    Point action_loc;
-    std::vector<ActionAffectedDetails> affected;
-};
+        SpscRing<Message*> ring;
 
+        std::deque<Message*> overflow;
+        std::atomic<unsigned int> spilled;
 
-// Adapted from http://www.justsoftwaresolutions.co.uk/threading/ ->
-//           -> implementing-a-thread-safe-queue-using-condition-variables.html
-class MessageQueue
-{
-private:
-    std::queue<Message*> the_queue;
-    mutable boost::mutex the_mutex;
-    boost::condition_variable the_condition_variable;
-public:
-    void push(Message* data)
+        // Written by the consumer only.
+        unsigned long pops;
+        std::atomic<unsigned long> max_depth;
+        std::atomic<unsigned long> messages;
+        std::atomic<unsigned long> waited;
+        std::atomic<unsigned long> wait_total;
+        std::atomic<unsigned long> wait_max;
+
+        // Written by the producer only.
+        std::atomic<unsigned long> drops;
+        std::atomic<unsigned long> coalesced;
+        std::atomic<unsigned long> stalls;
+    };
+
+    inline Lane& LaneOf(const Message* message) const
     {
-        boost::mutex::scoped_lock lock(the_mutex);
-        the_queue.push(data);
-        lock.unlock();
-        the_condition_variable.notify_one();
+        return *lanes[lane_count == 1 ? 0 : message->GetLane()];
     }
 
-    bool empty() const
+    void Push(Lane& lane, Message* const* data, size_t count)
     {
+        size_t pushed = 0;
+
+        if (lane.spilled.load(std::memory_order_acquire) == 0)
+            pushed = lane.ring.try_push_many(data, count);
+
+        if (pushed == count)
+            return;
+
         boost::mutex::scoped_lock lock(the_mutex);
-        return the_queue.empty();
+
+        for (size_t i = pushed; i < count; i++)
+            Spill(lane, data[i], lock);
     }
 
-    Message* try_pop()
+    // Called with the lock held.
+    void Spill(Lane& lane, Message* message, boost::mutex::scoped_lock& lock)
     {
-        boost::mutex::scoped_lock lock(the_mutex);
+        if (policy != QUEUE_SPILL && lane.overflow.size() >= spill_limit)
+        {
+            switch (policy)
+            {
+            case QUEUE_BLOCK:
+                lane.stalls.fetch_add(1, std::memory_order_relaxed);
 
-        if(the_queue.empty())
-            return NULL;
+                // The consumer may have gone to sleep before anything was
+                // pushed; it has to be up to make room.
+                if (waiting.load())
+                    the_condition_variable.notify_one();
 
-        Message* ret = the_queue.front();
-        the_queue.pop();
-        return ret;
+                producer_waiting = true;
+                while (lane.overflow.size() >= spill_limit)
+                    space_available.wait(lock);
+                producer_waiting = false;
+                break;
+            case QUEUE_DROP_NEWEST:
+                lane.drops.fetch_add(1, std::memory_order_relaxed);
+                message->Release();
+                return;
+            case QUEUE_COALESCE:
+                if (Replace(lane, message))
+                    return;
+                // Fall through
+            default:
+                lane.drops.fetch_add(1, std::memory_order_relaxed);
+                lane.overflow.front()->Release();
+                lane.overflow.pop_front();
+                lane.overflow.push_back(message);
+                return;
+            }
+        }
+
+        lane.overflow.push_back(message);
+        lane.spilled.fetch_add(1, std::memory_order_release);
     }
 
-    Message* wait_and_pop()
+    // Called with the lock held. If message is a move, replaces the latest
+    // spilled move for the same entity with it, unless an appear, identity,
+    // disappear or snapshot delta was spilled after that move.
+    bool Replace(Lane& lane, Message* message)
+    {
+        if (message->GetType() != MSG_ENTITY_MOVE)
+            return false;
+
+        unsigned int id = static_cast<EntityMessage*>(message)->entity_id;
+
+        for (auto it = lane.overflow.rbegin(); it != lane.overflow.rend();
+             ++it)
+        {
+            switch ((*it)->GetType())
+            {
+            case MSG_ENTITY_MOVE:
+                if (static_cast<EntityMessage*>(*it)->entity_id != id)
+                    break;
+
+                (*it)->Release();
+                lane.overflow.erase(std::next(it).base());
+                lane.overflow.push_back(message);
+                lane.coalesced.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            case MSG_IDENTITY:
+            case MSG_ENTITY_APPEAR:
+            case MSG_ENTITY_DISAPPEAR:
+            case MSG_ENTITY_DELTA:
+                return false;
+            }
+        }
+
+        return false;
+    }
+
+    size_t Drain(Lane& lane, std::vector<Message*>& out, size_t max)
     {
+        if (!max)
+            return 0;
+
+        size_t count = lane.ring.drain_into(out, max);
+
+        if (count == max || lane.spilled.load(std::memory_order_acquire) == 0)
+            return count;
+
+        count += lane.ring.drain_into(out, max - count);
+
+        if (count == max)
+            return count;
+
         boost::mutex::scoped_lock lock(the_mutex);
-        while(the_queue.empty())
-            the_condition_variable.wait(lock);
 
-        Message* ret = the_queue.front();
-        the_queue.pop();
-        return ret;
+        size_t taken = 0;
+        while (!lane.overflow.empty() && count + taken < max)
+        {
+            out.push_back(lane.overflow.front());
+            lane.overflow.pop_front();
+            taken++;
+        }
+
+        lane.spilled.fetch_sub(taken, std::memory_order_release);
+
+        if (taken && producer_waiting)
+            space_available.notify_one();
+
+        return count + taken;
+    }
+
+    // Updates a lane's stats for messages just taken out of it, and if
+    // timed, how long they waited.
+    void Account(Lane& lane, Message* const* taken, size_t count,
+                 size_t depth, bool timed)
+    {
+        lane.messages.store(lane.messages.load(std::memory_order_relaxed) +
+                            count, std::memory_order_relaxed);
+
+        if (depth > lane.max_depth.load(std::memory_order_relaxed))
+            lane.max_depth.store(depth, std::memory_order_relaxed);
+
+        if (!timed)
+            return;
+
+        unsigned long long now = Time::GetMicros();
+        unsigned long stamped = 0;
+        unsigned long total = 0;
+        unsigned long longest = 0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            unsigned long long since =
+                taken[i]->GetStamp(TRACE_DISPATCHED);
+            if (!since)
+                since = taken[i]->GetStamp(TRACE_CREATED);
+
+            // Not traced, so there is nothing to measure from.
+            if (!since)
+                continue;
+
+            unsigned long wait = now > since ? now - since : 0;
+            stamped++;
+            total += wait;
+            if (wait > longest)
+                longest = wait;
+        }
+
+        lane.waited.store(lane.waited.load(std::memory_order_relaxed) +
+                          stamped, std::memory_order_relaxed);
+        lane.wait_total.store(
+            lane.wait_total.load(std::memory_order_relaxed) + total,
+            std::memory_order_relaxed);
+
+        if (longest > lane.wait_max.load(std::memory_order_relaxed))
+            lane.wait_max.store(longest, std::memory_order_relaxed);
+    }
+
+    void wake_consumer()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (!waiting.load())
+            return;
+
+        boost::mutex::scoped_lock lock(the_mutex);
+        the_condition_variable.notify_one();
     }
 
+    Lane* lanes[LANE_COUNT];
+    const unsigned int lane_count;
+
+    const QUEUE_POLICY policy;
+    const unsigned int spill_limit;
+    const bool stats;
+
+    mutable boost::mutex the_mutex;
+    boost::condition_variable the_condition_variable;
+
+    // Guarded by the_mutex.
+    bool producer_waiting;
+    boost::condition_variable space_available;
+
+    const bool blocking;
+    std::atomic<bool> waiting;
 };
 
 
@@ -150,10 +1236,34 @@ public:
         output.push(message);
     }
 
+    void SendAll(const std::vector<Message*>& messages)
+    {
+        output.push_all(messages);
+    }
+
     Message* Poll()
     {
         return input.try_pop();
     }
+
+    // Appends every waiting message (or the oldest max of them) to messages
+    // and returns how many were added.
+    size_t PollAll(std::vector<Message*>& messages, size_t max = DRAIN_ALL)
+    {
+        return input.drain_into(messages, max);
+    }
+
+    // Approximate unless called by whoever polls the endpoint.
+    bool HasInput() const
+    {
+        return !input.empty();
+    }
+
+    // Only valid when the endpoint was registered in blocking mode.
+    Message* Wait()
+    {
+        return input.wait_and_pop();
+    }
 protected:
 private:
     MessageQueue& input;
@@ -161,6 +1271,25 @@ private:
 };
 
 
+struct RouteStats
+{
+    unsigned long messages;
+    unsigned long batches;
+};
+
+
+// Sees every message the router moves, just before it is handed to its
+// destination. A tap may inspect the messages but must not keep them.
+class RouterTap
+{
+public:
+    virtual ~RouterTap() {}
+
+    virtual void OnRoute(int from, int to,
+                         const std::vector<Message*>& messages) = 0;
+};
+
+
 class Router
 {
 private:
@@ -175,57 +1304,355 @@ private:
 
 public:
     Router()
+        : registered(0),
+          tap(NULL),
+          unroutable(0)
     {
+        static_assert(ADDR_COUNT <= 32,
+                      "Address sets are kept in 32-bit masks.");
+
+        for (unsigned int i = 0; i < ADDR_COUNT; i++)
+        {
+            endpoints[i].in = NULL;
+            endpoints[i].out = NULL;
+            endpoints[i].local = NULL;
+            endpoints[i].remote = NULL;
+
+            for (unsigned int j = 0; j < ADDR_COUNT; j++)
+            {
+                routes[i][j].messages = 0;
+                routes[i][j].batches = 0;
+            }
+        }
+
+        for (auto& s : subscribers)
+            s = 0;
     }
 
     virtual ~Router()
     {
         for (auto& e : endpoints)
         {
-            delete e.second.in;
-            delete e.second.out;
-            delete e.second.local;
-            delete e.second.remote;
+            delete e.in;
+            delete e.out;
+            delete e.local;
+            delete e.remote;
         }
     }
 
-    virtual Endpoint& Register(int address)
+    // Each queue has exactly one producer and one consumer: the router on
+    // one side and whoever holds the returned endpoint on the other. Pass
+    // blocking = true to be able to Wait() on the returned endpoint.
+    //
+    // Both queues are prioritized, so control messages get past a backlog
+    // of entity updates in either direction. options bounds the
+    // queue from the router to the endpoint, the one that grows when the
+    // endpoint's owner falls behind; the router is never slow to drain.
+    // Its stats flag applies to both queues.
+    virtual Endpoint& Register(int address, bool blocking = false,
+                               const QueueOptions& options = QueueOptions())
     {
-        EndpointData d;
+        if (address < 0 || address >= ADDR_COUNT)
+            throw std::runtime_error("Invalid endpoint address.");
+
+        EndpointData& d = endpoints[address];
+
+        if (d.local)
+            throw std::runtime_error("Endpoint address already registered.");
+
+        QueueOptions in_options;
+        in_options.stats = options.stats;
 
-        d.in = new MessageQueue();
-        d.out = new MessageQueue();
+        d.in = new MessageQueue(in_options, false, true);
+        d.out = new MessageQueue(options, blocking, true);
 
         d.local = new Endpoint(*d.in, *d.out);
         d.remote = new Endpoint(*d.out, *d.in);
 
-        endpoints.insert(std::pair<int,EndpointData>(address, d));
+        registered |= 1u << address;
 
         return *d.remote;
     }
 
-    virtual void Dispatch()
+    // Delivers every message of type topic to address as well, on top of
+    // its normal destination. Subscribers share the one message: each gets
+    // a reference, and must treat it as read-only.
+    void Subscribe(int topic, int address)
     {
-        for (auto& e : endpoints)
+        if (topic < 0 || topic >= MSG_TYPE_COUNT)
+            throw std::runtime_error("Invalid message topic.");
+
+        if (address < 0 || address >= ADDR_COUNT)
+            throw std::runtime_error("Invalid endpoint address.");
+
+        subscribers[topic] |= 1u << address;
+    }
+
+    void Unsubscribe(int topic, int address)
+    {
+        if (topic < 0 || topic >= MSG_TYPE_COUNT ||
+            address < 0 || address >= ADDR_COUNT)
+            return;
+
+        subscribers[topic] &= ~(1u << address);
+    }
+
+    // Moves everything waiting at each endpoint in one pass. If budget is
+    // given, at most that many messages are taken from any one endpoint and
+    // the rest wait for the next call; higher lanes get most of the budget,
+    // but every lane gets some (see MessageQueue::drain_into).
+    //
+    // Traffic from the uplink goes where GetDestination() says; anything
+    // else goes to the uplink. Subscribers of a message's type get it too,
+    // except the endpoint that sent it.
+    virtual void Dispatch(size_t budget = DRAIN_ALL)
+    {
+        for (int address = 0; address < ADDR_COUNT; address++)
         {
-            Message* message = e.second.local->Poll();
+            EndpointData& e = endpoints[address];
 
-            if (!message)
+            if (!e.local)
                 continue;
 
-            if (e.first != ADDR_UPLINK)
-            {
-                endpoints[ADDR_UPLINK].local->Send(message);
+            batch.clear();
+
+            if (!e.local->PollAll(batch, budget))
                 continue;
+
+            unsigned long long now =
+                Message::IsTracing() ? Time::GetMicros() : 0;
+
+            for (auto& message : batch)
+            {
+                if (now)
+                    message->Stamp(TRACE_DISPATCHED, now);
+
+                int destination = address == ADDR_UPLINK ?
+                    message->GetDestination() : ADDR_UPLINK;
+
+                unsigned int targets = subscribers[message->GetType()];
+
+                if (destination >= 0 && destination < ADDR_COUNT)
+                    targets |= 1u << destination;
+
+                targets &= registered & ~(1u << address);
+
+                if (!targets)
+                {
+                    unroutable++;
+                    message->Release();
+                    continue;
+                }
+
+                unsigned int count = 0;
+
+                for (int to = 0; targets; to++, targets >>= 1)
+                    if (targets & 1)
+                    {
+                        outgoing[to].push_back(message);
+                        count++;
+                    }
+
+                // The message arrived with one reference; every other
+                // recipient needs its own.
+                if (count > 1)
+                    message->AddRef(count - 1);
             }
 
-            endpoints[message->GetDestination()].local->Send(message);
+            for (int to = 0; to < ADDR_COUNT; to++)
+                if (!outgoing[to].empty())
+                {
+                    Forward(address, to, outgoing[to]);
+                    outgoing[to].clear();
+                }
         }
     }
+
+    // Throughput counters for traffic from one address to another.
+    inline RouteStats const& GetRouteStats(int from, int to) const
+    {
+        return routes[from][to];
+    }
+
+    // Messages released because nothing was registered at their
+    // destination.
+    inline unsigned long GetUnroutableCount() const { return unroutable; }
+
+    // Depth and wait time of one lane of the queue from address to the
+    // router. Waits end when the router picks the message up.
+    LaneStats GetInboundLaneStats(int address, int lane) const
+    {
+        if (address < 0 || address >= ADDR_COUNT || !endpoints[address].in)
+            return LaneStats();
+
+        return endpoints[address].in->lane_stats(lane);
+    }
+
+    // Same for the queue from the router to address. Waits start at
+    // dispatch and end when the endpoint's owner polls.
+    LaneStats GetOutboundLaneStats(int address, int lane) const
+    {
+        if (address < 0 || address >= ADDR_COUNT || !endpoints[address].out)
+            return LaneStats();
+
+        return endpoints[address].out->lane_stats(lane);
+    }
+
+    // Installs (or, with NULL, removes) a tap. Not owned by the router.
+    inline void SetTap(RouterTap* tap) { this->tap = tap; }
 protected:
 private:
-    EndpointData uplink;
-    std::map<int,EndpointData> endpoints;
+    void Forward(int from, int to, const std::vector<Message*>& messages)
+    {
+        if (tap)
+            tap->OnRoute(from, to, messages);
+
+        endpoints[to].local->SendAll(messages);
+
+        routes[from][to].messages += messages.size();
+        routes[from][to].batches++;
+    }
+
+    EndpointData endpoints[ADDR_COUNT];
+    RouteStats routes[ADDR_COUNT][ADDR_COUNT];
+
+    // Bit n set means address n: registered, or subscribed to a topic.
+    unsigned int registered;
+    unsigned int subscribers[MSG_TYPE_COUNT];
+
+    RouterTap* tap;
+    unsigned long unroutable;
+
+    std::vector<Message*> batch;
+    std::vector<Message*> outgoing[ADDR_COUNT];
+};
+
+
+// Sits between Router::Dispatch and the client. Within one batch (one
+// tick's worth of traffic for an endpoint) it drops updates that a later
+// message in the same batch makes redundant:
+//
+//  - an EntityMoveMessage replaces the whole path and speed, so only the
+//    last one per entity matters;
+//  - an actor has only one current action, so an earlier EntityActionMessage
+//    from the same actor is folded into the later one. HP updates for
+//    targets the later message does not mention are carried over; for
+//    targets it does, the later HP wins.
+//
+// Any other message is a barrier: nothing is folded across one, so an
+// update never moves past the appear, disappear or snapshot delta it
+// depends on. That only holds if the batch has each entity's messages in
+// the order they were sent. A batch from one MessageQueue does, since
+// everything about an entity shares a lane (see Message::GetLane), so only
+// use this on such a batch, before anything else reorders it.
+class MessageCoalescer
+{
+public:
+    MessageCoalescer()
+        : elided_moves(0),
+          elided_actions(0)
+    { }
+
+    void Coalesce(std::vector<Message*>& batch)
+    {
+        pending_moves.clear();
+        pending_actions.clear();
+
+        bool elided = false;
+
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            Message* m = batch[i];
+
+            switch (m->GetType())
+            {
+            case MSG_ENTITY_MOVE:
+            {
+                unsigned int id = static_cast<EntityMessage*>(m)->entity_id;
+                auto it = pending_moves.find(id);
+
+                if (it == pending_moves.end())
+                {
+                    pending_moves[id] = i;
+                    break;
+                }
+
+                batch[it->second]->Release();
+                batch[it->second] = NULL;
+                it->second = i;
+
+                elided_moves++;
+                elided = true;
+                break;
+            }
+            case MSG_ENTITY_ACTION:
+            {
+                EntityActionMessage* a = static_cast<EntityActionMessage*>(m);
+                auto it = pending_actions.find(a->entity_id);
+
+                // A shared message is read-only, so the older one is left
+                // alone rather than merged into it.
+                if (it == pending_actions.end() || a->IsShared())
+                {
+                    pending_actions[a->entity_id] = i;
+                    break;
+                }
+
+                EntityActionMessage* old =
+                    static_cast<EntityActionMessage*>(batch[it->second]);
+
+                Merge(*old, *a);
+
+                old->Release();
+                batch[it->second] = NULL;
+                it->second = i;
+
+                elided_actions++;
+                elided = true;
+                break;
+            }
+            default:
+                pending_moves.clear();
+                pending_actions.clear();
+            }
+        }
+
+        if (elided)
+            batch.erase(std::remove(batch.begin(), batch.end(),
+                                    (Message*)NULL),
+                        batch.end());
+    }
+
+    inline unsigned long GetElidedMoves() const { return elided_moves; }
+    inline unsigned long GetElidedActions() const { return elided_actions; }
+private:
+    // Carries over HP updates from old for targets newer does not mention.
+    static void Merge(const EntityActionMessage& old,
+                      EntityActionMessage& newer)
+    {
+        const size_t count = newer.affected.size();
+
+        for (auto& o : old.affected)
+        {
+            bool found = false;
+
+            for (size_t i = 0; i < count; i++)
+                if (newer.affected[i].entity_id == o.entity_id)
+                {
+                    found = true;
+                    break;
+                }
+
+            if (!found)
+                newer.affected.push_back(o);
+        }
+    }
+
+    std::unordered_map<unsigned int,size_t> pending_moves;
+    std::unordered_map<unsigned int,size_t> pending_actions;
+
+    unsigned long elided_moves;
+    unsigned long elided_actions;
 };
 
 #endif
@@ -1,12 +1,20 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <chrono>
+
 #include <SDL2/SDL.h>
 
 struct Point
 {
     Point(int x = 0, int y = 0) : x(x), y(y) { }
 
+    inline bool operator==(const Point& o) const
+    {
+        return x == o.x && y == o.y;
+    }
+    inline bool operator!=(const Point& o) const { return !(*this == o); }
+
     int x;
     int y;
 };
@@ -22,6 +30,14 @@ public:
     {
         __NOW = SDL_GetTicks();
     }
+
+    // Monotonic microseconds, independent of the frame clock above. For
+    // measuring, not for game logic.
+    static inline unsigned long long GetMicros()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
 };
 
 #endif
@@ -3,9 +3,15 @@
 
 #include <vector>
 #include <string>
+#include <algorithm>
 
 #include "common.h"
 #include "comm.h"
+#include "path.h"
+#include "slotmap.h"
+#include "characters.h"
+#include "spatial.h"
+#include "timerwheel.h"
 
 
 class Skill
@@ -16,6 +22,12 @@ class Skill
 class Entity
 {
 public:
+    Entity()
+        : spatial(NULL)
+    { }
+
+    virtual ~Entity() {}
+
     virtual void Update() {}
 
     inline int GetID() const { return id; }
@@ -24,24 +36,57 @@ public:
     inline std::string GetName() const { return name; }
     inline void SetName(const std::string& name) { this->name = name; }
 
-    inline Point& GetLoc() { return loc; }
-    inline void SetLoc(Point loc) { this->loc = loc; }
+    virtual Point GetLoc() const { return loc; }
+    virtual void SetLoc(Point loc)
+    {
+        this->loc = loc;
+
+        if (spatial)
+            spatial->Move(handle, loc);
+    }
+
+    // Set by GameEngine::Register.
+    inline SlotHandle GetHandle() const { return handle; }
+    inline void SetHandle(SlotHandle handle) { this->handle = handle; }
+
+    // Keeps the entity filed in spatial under its handle as it moves, or
+    // takes it out for NULL. Set by GameEngine::Register, after the handle.
+    virtual void SetSpatial(SpatialGrid* spatial)
+    {
+        if (this->spatial)
+            this->spatial->Remove(handle);
+
+        this->spatial = spatial;
+
+        if (spatial)
+            spatial->Insert(handle, loc);
+    }
+
+    // The GraphicsEngine component showing the entity, if any.
+    inline SlotHandle GetComponent() const { return component; }
+    inline void SetComponent(SlotHandle val) { this->component = val; }
 private:
     unsigned int id;
     std::string name;
     Point loc;
+
+    SlotHandle handle;
+    SlotHandle component;
+    SpatialGrid* spatial;
 };
 
 
 class Character;
 
 
+// Actions refer to characters by handle; see GameEngine::GetCharacter. A
+// character can disappear while an action still names it.
 class Action
 {
 public:
     enum ActionDuration { DURATION_INFINITE = -1 };
 
-    Action(Character& actor)
+    Action(SlotHandle actor)
         : actor(actor)
     {
         started_at = Time::GetNow();
@@ -49,7 +94,7 @@ public:
 
     virtual ~Action() {}
 
-    inline Character& GetActor() const { return actor; }
+    inline SlotHandle GetActor() const { return actor; }
 
     inline unsigned int GetStartedAt() const { return started_at; }
     inline void SetStartedAt(unsigned int val) { this->started_at = val; }
@@ -64,7 +109,7 @@ public:
     }
 
 private:
-    Character& actor;
+    SlotHandle actor;
     unsigned int started_at;
     unsigned int duration = 1000;
 };
@@ -72,7 +117,7 @@ private:
 
 class IdleAction : public Action
 {
-    IdleAction(Character& actor)
+    IdleAction(SlotHandle actor)
         : Action(actor)
     {
         SetDuration(-1);
@@ -83,66 +128,66 @@ class IdleAction : public Action
 class SkillAction : public Action
 {
 public:
-    SkillAction(Character& actor, Skill& skill)
+    SkillAction(SlotHandle actor, Skill& skill)
         : Action(actor),
           skill(skill) {}
 
     inline Skill& GetSkill() const { return skill; }
 
-    inline std::vector<Character*> const& GetTargets() const
+    inline std::vector<SlotHandle> const& GetTargets() const
     {
         return targets;
     }
-    inline std::vector<Character*>& GetTargetsMutable() { return targets; }
+    inline std::vector<SlotHandle>& GetTargetsMutable() { return targets; }
 
 private:
     Skill& skill;
-    std::vector<Character*> targets;
+    std::vector<SlotHandle> targets;
 };
 
 
 class Character : public Entity
 {
 public:
-    virtual void Update()
+    // Takes a row in store for as long as the character exists. Movement
+    // happens in CharacterStore::Update, for all characters at once.
+    Character(CharacterStore& store)
+        : store(store),
+          state(store.Add())
+    { }
+
+    virtual ~Character()
     {
-        unsigned int now = Time::GetNow();
+        store.Remove(state);
+    }
 
-        if (IsMoving())
-        {
-            unsigned int delta = now - last_move;
+    virtual Point GetLoc() const { return store.GetLoc(Row()); }
+    virtual void SetLoc(Point loc) { store.SetLoc(Row(), loc); }
 
-            if (delta > speed)
-            {
-                unsigned int remainder = delta % speed;
-                unsigned int temp = delta - remainder;
-                unsigned int complete_moves = temp / speed;
-
-                for (unsigned int i = 0; i < complete_moves; i++)
-                {
-                    if (path.size() == 0)
-                        break;
-
-                    SetLoc(*path.begin());
-                    path.erase(path.begin());
-                    last_move = now - remainder;
-                }
-            }
-        }
+    // Characters are filed by their store, which moves them, in the grid
+    // it was made with.
+    virtual void SetSpatial(SpatialGrid* spatial)
+    {
+        store.SetEntity(Row(), spatial ? GetHandle() : SlotHandle());
     }
 
     void ClearPath()
     {
-        path.clear();
+        store.ClearPath(Row());
     }
 
-    void QueuePath(Point point)
+    // Appends a tile next to the end of the path (or anywhere, if not
+    // moving). Returns false if it is not next to the end.
+    bool QueuePath(Point point)
     {
-        // If not already moving, delay the first move
-        if (!IsMoving())
-            last_move = Time::GetNow();
+        return store.QueuePath(Row(), point, Time::GetNow());
+    }
 
-        path.push_back(point);
+    // Replaces the path. The legs are walked as they are, one step at a
+    // time, without expanding them into tiles.
+    void SetPath(const Path& path)
+    {
+        store.SetPath(Row(), path, Time::GetNow());
     }
 
     Point DirectionMoving()
@@ -152,7 +197,7 @@ public:
         if (!IsMoving())
             return ret;
 
-        Point next = *path.begin();
+        Point next = store.GetPath(Row()).Next();
         Point loc = GetLoc();
 
         if (next.x > loc.x)
@@ -168,39 +213,160 @@ public:
         return ret;
     }
 
-    inline int GetLastMove() { return last_move; }
-    inline bool IsMoving() { return path.size() > 0; }
-    inline int GetSpeed() const { return speed; }
-    inline void SetSpeed(unsigned int speed) { this->speed = speed; }
-    inline int GetHP() const { return hp; }
-    inline void SetHP(unsigned int hp) { this->hp = hp; }
+    inline int GetLastMove() { return store.GetLastMove(Row()); }
+    inline bool IsMoving() { return store.IsMoving(Row()); }
+    inline int GetSpeed() const { return store.GetSpeed(Row()); }
+    inline void SetSpeed(unsigned int speed) { store.SetSpeed(Row(), speed); }
+    inline int GetHP() const { return store.GetHP(Row()); }
+    inline void SetHP(unsigned int hp) { store.SetHP(Row(), hp); }
 
     Point GetPathEnd()
     {
         if (!IsMoving())
             return GetLoc();
 
-        return *(path.end() - 1);
+        return store.GetPath(Row()).GetEnd();
     }
 
-    inline Action const* GetAction() const { return action; }
-    inline Action* GetActionMutable() { return action; }
-    inline void SetAction(Action* action) { this->action = action; }
-    inline void ResetAction() { this->action = NULL; }
+    // Handles into GameEngine's actions.
+    inline SlotHandle GetAction() const { return action; }
+    inline void SetAction(SlotHandle action) { this->action = action; }
+    inline void ResetAction() { this->action = SlotHandle(); }
 
-    inline std::vector<Action*> const& GetAffectedBy() const
+    inline std::vector<SlotHandle> const& GetAffectedBy() const
+        { return affected_by; }
+    inline std::vector<SlotHandle>& GetAffectedByMutable()
         { return affected_by; }
-    inline std::vector<Action*>& GetAffectedByMutable() { return affected_by; }
 
 protected:
 private:
-    std::vector<Point> path;
-    unsigned int last_move;
-    unsigned int speed = 125;
-    unsigned int hp = 100;
+    inline unsigned int Row() const { return store.GetRow(state); }
 
-    Action* action = NULL;
-    std::vector<Action*> affected_by;
+    CharacterStore& store;
+    SlotHandle state;
+
+    SlotHandle action;
+    std::vector<SlotHandle> affected_by;
+};
+
+
+// Maps entity ids to their handles in GameEngine's entities. Open
+// addressing with linear probing, kept at most half full; removal shifts
+// the rest of the probe run back instead of leaving tombstones, so lookups
+// never slow down as entities come and go.
+class EntityIndex
+{
+public:
+    EntityIndex()
+        : count(0)
+    {
+        Rehash(MIN_CAPACITY);
+    }
+
+    // A null handle if entity_id is not there.
+    inline SlotHandle Find(unsigned int entity_id) const
+    {
+        for (size_t i = Home(entity_id); slots[i].used; i = (i + 1) & mask)
+            if (slots[i].key == entity_id)
+                return slots[i].value;
+
+        return SlotHandle();
+    }
+
+    // Adds or updates entity_id.
+    void Set(unsigned int entity_id, SlotHandle handle)
+    {
+        if ((count + 1) * 2 > slots.size())
+            Rehash(slots.size() * 2);
+
+        size_t i = Home(entity_id);
+
+        for (; slots[i].used; i = (i + 1) & mask)
+            if (slots[i].key == entity_id)
+            {
+                slots[i].value = handle;
+                return;
+            }
+
+        slots[i].used = true;
+        slots[i].key = entity_id;
+        slots[i].value = handle;
+        count++;
+    }
+
+    void Remove(unsigned int entity_id)
+    {
+        size_t i = Home(entity_id);
+
+        for (; slots[i].used; i = (i + 1) & mask)
+            if (slots[i].key == entity_id)
+                break;
+
+        if (!slots[i].used)
+            return;
+
+        // Pull back every later entry in the run that may sit at i, so a
+        // probe for it does not stop at the gap.
+        size_t gap = i;
+
+        for (size_t j = (i + 1) & mask; slots[j].used; j = (j + 1) & mask)
+        {
+            size_t home = Home(slots[j].key);
+
+            if (((j - home) & mask) >= ((j - gap) & mask))
+            {
+                slots[gap] = slots[j];
+                gap = j;
+            }
+        }
+
+        slots[gap].used = false;
+        count--;
+    }
+
+    inline size_t GetCount() const { return count; }
+private:
+    enum { MIN_CAPACITY = 64 };
+
+    struct Slot
+    {
+        unsigned int key;
+        SlotHandle value;
+        bool used;
+    };
+
+    // Fibonacci hashing: ids are mostly sequential, and this spreads them.
+    inline size_t Home(unsigned int key) const
+    {
+        return (size_t)((key * 2654435769u) >> shift) & mask;
+    }
+
+    void Rehash(size_t capacity)
+    {
+        std::vector<Slot> old;
+        old.swap(slots);
+
+        slots.resize(capacity, Slot());
+        mask = capacity - 1;
+
+        shift = 32;
+        while (capacity > 1)
+        {
+            capacity >>= 1;
+            shift--;
+        }
+
+        count = 0;
+
+        for (auto& s : old)
+            if (s.used)
+                Set(s.key, s.value);
+    }
+
+    std::vector<Slot> slots;
+    size_t mask;
+    unsigned int shift;
+    size_t count;
 };
 
 
@@ -208,18 +374,22 @@ class GameEngine
 {
 public:
     GameEngine(Endpoint& endpoint)
-        : endpoint(endpoint)
+        : characters(&spatial),
+          endpoint(endpoint)
     {
         Time::UpdateNow();
+
+        // Nothing is scheduled yet, so this only sets the wheel's clock.
+        expiries.Advance(Time::GetNow(), expired);
     }
 
     virtual ~GameEngine()
     {
-        for (unsigned int i = 0; i < entities.size(); i++)
-            delete entities[i];
+        for (auto& e : entities)
+            delete e;
 
-        for (unsigned int i = 0; i < actions.size(); i++)
-            delete actions[i];
+        for (auto& a : actions)
+            delete a;
     }
 
     virtual void Update()
@@ -228,112 +398,164 @@ public:
 
         PruneActions();
 
-        /*
-        while (Message* msg = endpoint.Poll())
-        {
-            std::cout << "message received in game engine" << std::endl;
-            delete msg;
-        }
-        */
-        for (auto &e : entities)j
-            e->Update();
+        characters.Update(Time::GetNow());
     }
 
-    void Register(Entity* entity)
+    // The entity's id has to be set already, and unique.
+    SlotHandle Register(Entity* entity)
     {
-        entities.push_back(entity);
+        if (!index.Find(entity->GetID()).IsNull())
+            throw std::runtime_error("Entity ID already registered.");
+
+        SlotHandle handle = entities.Insert(entity);
+        entity->SetHandle(handle);
+        entity->SetSpatial(&spatial);
+        index.Set(entity->GetID(), handle);
+
+        return handle;
     }
 
+    // Handles to the entity go stale; anything still holding one gets NULL
+    // from GetEntity from now on.
     void Deregister(Entity* entity)
     {
-        unsigned int offset = 0;
-        for (auto &e : entities) {
-            if (e == entity)
-                goto found;
-            offset++;
-        }
-        throw std::runtime_error("Entity not found.");
-    found:
-        entities.erase(entities.begin() + offset);
+        if (!entities.Erase(entity->GetHandle()))
+            throw std::runtime_error("Entity not found.");
+
+        index.Remove(entity->GetID());
+        entity->SetSpatial(NULL);
+        entity->SetHandle(SlotHandle());
+    }
+
+    // NULL if the handle is stale.
+    inline Entity* GetEntity(SlotHandle handle)
+    {
+        Entity** ret = entities.Get(handle);
+        return ret ? *ret : NULL;
+    }
+
+    // NULL if the handle is stale or not a character.
+    inline Character* GetCharacter(SlotHandle handle)
+    {
+        return dynamic_cast<Character*>(GetEntity(handle));
+    }
+
+    inline Action* GetAction(SlotHandle handle)
+    {
+        Action** ret = actions.Get(handle);
+        return ret ? *ret : NULL;
     }
 
     Entity* GetEntityByID(unsigned int entity_id)
     {
-        for (auto &e : entities)
-            if (e->GetID() == entity_id)
-                return e;
+        if (Entity* ret = TryGetEntityByID(entity_id))
+            return ret;
 
         throw std::runtime_error("Entity not found.");
     }
 
-    void Register(Action& action)
+    // NULL if there is no such entity.
+    inline Entity* TryGetEntityByID(unsigned int entity_id)
     {
-        std::cout << action.GetActor().GetName() << std::endl;
-        action.GetActor().SetAction(&action);
+        return GetEntity(index.Find(entity_id));
+    }
+
+    // Takes ownership of the action. Its expiry is scheduled from its start
+    // and duration as they are now; DURATION_INFINITE actions are never
+    // looked at again until they are ended.
+    SlotHandle Register(Action& action)
+    {
+        SlotHandle handle = actions.Insert(&action);
+
+        if (action.GetDuration() != (unsigned int)Action::DURATION_INFINITE)
+            expiries.Schedule(handle,
+                              action.GetStartedAt() + action.GetDuration());
+
+        if (Character* actor = GetCharacter(action.GetActor()))
+            actor->SetAction(handle);
 
         if (SkillAction* skill_action = dynamic_cast<SkillAction*>(&action))
             for (auto& t : skill_action->GetTargets())
-                t->GetAffectedByMutable().push_back(skill_action);
+                if (Character* target = GetCharacter(t))
+                    target->GetAffectedByMutable().push_back(handle);
 
-        actions.push_back(&action);
+        return handle;
     }
 
-    inline Character* GetAvatar() const { return avatar; }
-    inline void SetAvatar(Character* avatar) { this->avatar = avatar; }
+    // For creating characters.
+    inline CharacterStore& GetCharacterStore() { return characters; }
+
+    // Every registered entity by where it is, under its handle.
+    inline SpatialGrid const& GetSpatial() const { return spatial; }
+
+    // Ends an action before its time; false if it has already gone.
+    bool EndAction(SlotHandle handle)
+    {
+        if (!GetAction(handle))
+            return false;
+
+        expiries.Cancel(handle);
+        RemoveAction(handle);
+
+        return true;
+    }
+
+    inline Character* GetAvatar() { return GetCharacter(avatar); }
+    inline void SetAvatar(Character* avatar)
+    {
+        this->avatar = avatar ? avatar->GetHandle() : SlotHandle();
+    }
 protected:
+    // Only the actions whose time is up are looked at.
     void PruneActions()
     {
-        std::vector<unsigned int> to_delete;
-        unsigned int action_index = -1;
+        expired.clear();
+        expiries.Advance(Time::GetNow(), expired);
 
-        for (auto& a : actions)
-        {
-            //std::cout << "action" << action_index << std::endl;
-            action_index++;
-
-            if (a->IsActive())
-                continue;
-            std::cout << "action gone inactive" << std::endl;
-            a->GetActor().ResetAction();
-            std::cout << "actor reset" << std::endl;
-            if (SkillAction* skill_action = dynamic_cast<SkillAction*>(a))
-                for (auto& t : skill_action->GetTargets())
-                {
-                    std::cout << "target" << std::endl;
-                    std::vector<Action*>& affected_by =
-                        t->GetAffectedByMutable();
-
-                    unsigned int index = -1;
-                    for (unsigned int i = 0; i < affected_by.size(); i++)
-                        if (affected_by[i] == a)
-                        {
-                            index = i;
-                            break;
-                        }
-
-                    if (index == -1)
-                        continue;
-
-                    affected_by.erase(affected_by.begin() + index);
-                    std::cout << "target cleared" << std::endl;
-                }
-
-            to_delete.insert(to_delete.begin(), action_index);
-            std::cout << "delete queued" << std::endl;
-        }
+        for (auto& handle : expired)
+            RemoveAction(handle);
+    }
 
-        for (auto& i : to_delete)
-        {
-            Action* action = actions[i];
-            std::cout << "action deleting" << std::endl;
-            actions.erase(actions.begin() + i);
-            delete action;
-        }
+    // Unhooks the action from its actor and targets and deletes it.
+    void RemoveAction(SlotHandle handle)
+    {
+        Action* a = GetAction(handle);
+
+        // The actor may have gone, or moved on to another action.
+        Character* actor = GetCharacter(a->GetActor());
+        if (actor && actor->GetAction() == handle)
+            actor->ResetAction();
+
+        if (SkillAction* skill_action = dynamic_cast<SkillAction*>(a))
+            for (auto& t : skill_action->GetTargets())
+            {
+                Character* target = GetCharacter(t);
+                if (!target)
+                    continue;
+
+                std::vector<SlotHandle>& affected_by =
+                    target->GetAffectedByMutable();
+
+                auto it = std::find(affected_by.begin(),
+                                    affected_by.end(), handle);
+
+                if (it != affected_by.end())
+                    affected_by.erase(it);
+            }
+
+        actions.Erase(handle);
+        delete a;
     }
 private:
-    std::vector<Entity*> entities;
-    std::vector<Action*> actions;
-    Character* avatar = NULL;
+    // Both outlive the characters, which give their rows back as they go.
+    SpatialGrid spatial;
+    CharacterStore characters;
+    SlotMap<Entity*> entities;
+    EntityIndex index;
+    SlotMap<Action*> actions;
+    TimerWheel expiries;
+    std::vector<SlotHandle> expired;
+    SlotHandle avatar;
     Endpoint& endpoint;
 };
 
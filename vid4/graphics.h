@@ -545,6 +545,10 @@ public:
 
     inline Transform& GetTransform() { return transform; }
 
+    // Set by GraphicsEngine::Register.
+    inline SlotHandle GetHandle() const { return handle; }
+    inline void SetHandle(SlotHandle handle) { this->handle = handle; }
+
     inline float GetDrawOrder() const
     {
         const float ret = transform.GetDrawOrder();
@@ -554,17 +558,22 @@ protected:
     AssetManager* asset_manager;
     Transform transform;
 private:
+    SlotHandle handle;
 };
 
 
 class YetiComponent : public Component
 {
 public:
-    YetiComponent(AssetManager& asset_manager,j
+    // The character is held by handle, so the component notices if it is
+    // deregistered first; it then stops drawing.
+    YetiComponent(AssetManager& asset_manager,
+                  GameEngine& game_engine,
                   Character& character,
                   const std::string& skin = "yeti")
         : Component(asset_manager),
-          character(character)
+          game_engine(game_engine),
+          character(character.GetHandle())
     {
         shader = asset_manager.GetShader("shader");
         texture = asset_manager.GetTexture(skin + ".png");
@@ -613,9 +622,16 @@ public:
     {
         static bool first_update = true;
 
+        Character* c = game_engine.GetCharacter(character);
+        visible = c != NULL;
+        if (!visible)
+            return;
+
+        Character& character = *c;
+
         tint = glm::vec4(0.0f, 0.0f, 0.0f, 0.0f);
 
-        if (character.GetAction() != NULL)
+        if (!character.GetAction().IsNull())
         {
             tint.z = 1.0f;
             tint.w = 0.5f;
@@ -657,6 +673,9 @@ public:
 
     void Draw(const Camera& camera)
     {
+        if (!visible)
+            return;
+
         shader->SetTint(tint);
         shader->Bind();
         shader->Update(transform, camera);
@@ -664,13 +683,15 @@ public:
         mesh->Draw();
     }
 
-    inline Character& GetCharacter() { return character; }
+    inline SlotHandle GetCharacter() const { return character; }
 protected:
 private:
     Shader* shader;
     Mesh* mesh;
     Texture* texture;
-    Character& character;
+    GameEngine& game_engine;
+    SlotHandle character;
+    bool visible = false;
     glm::vec4 tint;
 };
 
@@ -771,8 +792,8 @@ public:
 
     virtual ~GraphicsEngine()
     {
-        for (unsigned int i = 0; i < components.size(); i++)
-            delete components[i];
+        for (auto& c : components)
+            delete c;
 
         delete camera;
 
@@ -781,22 +802,25 @@ public:
         SDL_Quit();
     }
 
-    void Register(Component* component)
+    // Pass the entity the component shows, if any, so FindComponent can
+    // get from one to the other.
+    SlotHandle Register(Component* component, Entity* entity = NULL)
     {
-        components.push_back(component);
+        SlotHandle handle = components.Insert(component);
+        component->SetHandle(handle);
+
+        if (entity)
+            entity->SetComponent(handle);
+
+        return handle;
     }
 
     void Deregister(Component* component)
     {
-        unsigned int offset = 0;
-        for (auto &c : components) {
-            if (c == component)
-                goto found;
-            offset++;
-        }
-        throw std::runtime_error("Component not found.");
-    found:
-        components.erase(components.begin() + offset);
+        if (!components.Erase(component->GetHandle()))
+            throw std::runtime_error("Component not found.");
+
+        component->SetHandle(SlotHandle());
     }
 
     void Draw()
@@ -804,9 +828,11 @@ public:
         for (auto &c : components)
             c->Update();
 
-        if (Character* avatar = game_engine.GetAvatar())
+        Character* avatar = game_engine.GetAvatar();
+
+        if (Component* avatar_component = FindComponent(avatar))
         {
-            glm::vec3 avatar_pos = FindComponent(avatar)->
+            glm::vec3 avatar_pos = avatar_component->
                                    GetTransform().
                                    GetPos();
 
@@ -826,26 +852,31 @@ public:
         glEnable(GL_BLEND);
         glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-        std::sort(components.begin(), components.end(),
+        // The slot map's order is its own; sort a copy.
+        draw_order.assign(components.begin(), components.end());
+        std::sort(draw_order.begin(), draw_order.end(),
                 ComponentDrawOrderer());
 
-        for (auto &i : components)
+        for (auto &i : draw_order)
             i->Draw(*camera);
 
         SDL_GL_SwapWindow(window);
     }
 
+    // NULL if the entity was not registered with a component.
     Component* FindComponent(Entity* entity)
     {
-        for (auto &c : components)
-            if (YetiComponent* y = dynamic_cast<YetiComponent*>(c))
-                if (&y->GetCharacter() == entity)
-                    return y;
+        if (!entity)
+            return NULL;
+
+        Component** ret = components.Get(entity->GetComponent());
+        return ret ? *ret : NULL;
     }
 protected:
 private:
     GameEngine& game_engine;
-    std::vector<Component*> components;
+    SlotMap<Component*> components;
+    std::vector<Component*> draw_order;
     glm::vec3 world_transform;
     Camera* camera;
     SDL_Window* window;
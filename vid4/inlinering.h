@@ -0,0 +1,155 @@
+#ifndef INLINERING_H
+#define INLINERING_H
+
+#include <cstddef>
+
+
+// Double-ended queue that keeps up to N elements inside itself and only
+// goes to the heap past that. push_back and pop_front are O(1); the ring
+// doubles when full. N must be a power of two.
+template <typename T, unsigned int N>
+class InlineRing
+{
+public:
+    static_assert(N && !(N & (N - 1)), "N must be a power of two.");
+
+    InlineRing()
+        : data(inline_slots),
+          capacity(N),
+          head(0),
+          count(0)
+    { }
+
+    InlineRing(const InlineRing& other)
+        : data(inline_slots),
+          capacity(N),
+          head(0),
+          count(0)
+    {
+        *this = other;
+    }
+
+    // Takes over other's heap buffer, if it has one.
+    InlineRing(InlineRing&& other)
+        : data(inline_slots),
+          capacity(N),
+          head(0),
+          count(0)
+    {
+        *this = static_cast<InlineRing&&>(other);
+    }
+
+    ~InlineRing()
+    {
+        if (data != inline_slots)
+            delete[] data;
+    }
+
+    InlineRing& operator=(const InlineRing& other)
+    {
+        if (this == &other)
+            return *this;
+
+        clear();
+
+        for (size_t i = 0; i < other.count; i++)
+            push_back(other[i]);
+
+        return *this;
+    }
+
+    InlineRing& operator=(InlineRing&& other)
+    {
+        if (this == &other)
+            return *this;
+
+        if (other.data == other.inline_slots)
+            return *this = static_cast<const InlineRing&>(other);
+
+        if (data != inline_slots)
+            delete[] data;
+
+        data = other.data;
+        capacity = other.capacity;
+        head = other.head;
+        count = other.count;
+
+        other.data = other.inline_slots;
+        other.capacity = N;
+        other.head = 0;
+        other.count = 0;
+
+        return *this;
+    }
+
+    void push_back(const T& value)
+    {
+        if (count == capacity)
+            grow();
+
+        data[(head + count) & (capacity - 1)] = value;
+        count++;
+    }
+
+    // Not valid when empty.
+    inline void pop_front()
+    {
+        head = (head + 1) & (capacity - 1);
+        count--;
+    }
+
+    inline T& front() { return data[head]; }
+    inline const T& front() const { return data[head]; }
+    inline T& back() { return (*this)[count - 1]; }
+    inline const T& back() const { return (*this)[count - 1]; }
+
+    inline T& operator[](size_t i)
+    {
+        return data[(head + i) & (capacity - 1)];
+    }
+    inline const T& operator[](size_t i) const
+    {
+        return data[(head + i) & (capacity - 1)];
+    }
+
+    inline size_t size() const { return count; }
+    inline bool empty() const { return count == 0; }
+    inline bool is_inline() const { return data == inline_slots; }
+
+    // Also gives back any heap buffer.
+    void clear()
+    {
+        if (data != inline_slots)
+        {
+            delete[] data;
+            data = inline_slots;
+            capacity = N;
+        }
+
+        head = 0;
+        count = 0;
+    }
+private:
+    void grow()
+    {
+        T* bigger = new T[capacity * 2];
+
+        for (size_t i = 0; i < count; i++)
+            bigger[i] = (*this)[i];
+
+        if (data != inline_slots)
+            delete[] data;
+
+        data = bigger;
+        capacity *= 2;
+        head = 0;
+    }
+
+    T inline_slots[N];
+    T* data;
+    size_t capacity;
+    size_t head;
+    size_t count;
+};
+
+#endif
@@ -4,8 +4,10 @@
 #include <stdexcept>
 #include <vector>
 #include <map>
+#include <queue>
 #include <algorithm>
 #include <typeinfo>
+#include <cstdlib>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
@@ -15,11 +17,20 @@
 #include <glm/gtx/transform.hpp>
 
 #define TILE_SIZE 24
+#define SHM_UPLINK_NAME "/cg-vid4-uplink"
 
 #include "common.h"
 #include "comm.h"
+#include "codec.h"
 #include "game.h"
 #include "graphics.h"
+#include "net.h"
+#include "udp.h"
+#include "shm.h"
+#include "snapshot.h"
+#include "record.h"
+#include "scenario.h"
+#include "trace.h"
 
 
 Mesh* temp_gen_mesh()
@@ -82,163 +93,625 @@ bool temp_process_input(Character* avatar)
 }
 
 
-class ServerSimulator
+// What the server used to be simulated with: the avatar, and a 12 second
+// loop of Zathril fighting a yeti.
+#define DEMO_SCENARIO \
+    "script kirtah\n" \
+    "    wait 1000\n" \
+    "    identity Kirtah yeti Himalayas -5,0\n" \
+    "end\n" \
+    "script zathril\n" \
+    "    wait 1500\n" \
+    "    appear Zathril azlar 0,0\n" \
+    "    wait 200\n" \
+    "    act 3 4,5 self 100\n" \
+    "    wait 800\n" \
+    "    move 150 0,0 1,0 2,0 2,1 2,2 2,3 3,4 4,5\n" \
+    "    wait 2500\n" \
+    "    act 5 4,5 2 60\n" \
+    "    wait 1000\n" \
+    "    move 175 4,4 4,3 3,2 2,1 1,1\n" \
+    "    wait 500\n" \
+    "    act 5 4,5 2 20\n" \
+    "    wait 2500\n" \
+    "    disappear\n" \
+    "    wait 3000\n" \
+    "    repeat\n" \
+    "end\n" \
+    "script yeti\n" \
+    "    wait 2300\n" \
+    "    appear Yeti yeti 4,-2\n" \
+    "    wait 7700\n" \
+    "    disappear\n" \
+    "    wait 2000\n" \
+    "    repeat\n" \
+    "end\n" \
+    "spawn kirtah 1\n" \
+    "spawn zathril 1\n" \
+    "spawn yeti 1\n"
+
+
+// Stand-in for the server: plays the scenario file given, or the demo.
+ScenarioRuntime* CreateServerSimulator(Endpoint& uplink,
+                                       const char* scenario_path,
+                                       bool snapshots)
 {
-public:
-    ServerSimulator(Endpoint* uplink) : uplink(uplink) {}
+    ScenarioRuntime* ret = new ScenarioRuntime(uplink, snapshots);
 
-    void Update()
+    if (scenario_path)
+        ret->LoadFile(scenario_path);
+    else
+        ret->LoadString(DEMO_SCENARIO);
+
+    return ret;
+}
+
+
+// Times CharacterStore::Update for count characters walking long paths
+// at different speeds, and prints the cost per 16 ms tick.
+void BenchmarkCharacters(unsigned int count)
+{
+    const unsigned int TICKS = 1000;
+    const unsigned int FRAME = 16;
+
+    Path path;
+    path.Append(Point(0, 0));
+    for (int side = 0; side < 4; side++)
+        path.AppendLeg((DIR_EAST + side * 2) % DIR_COUNT, 10000);
+
+    CharacterStore store;
+
+    for (unsigned int i = 0; i < count; i++)
     {
-        static unsigned int state = -1000;
-        unsigned int now = Time::GetNow();
+        unsigned int row = store.GetRow(store.Add());
+        store.SetSpeed(row, 100 + i % 100);
+        store.SetPath(row, path, 0);
+    }
 
-        if (state == -1000 && now - start > 1000)
-        {
-            IdentityMessage* msg = new IdentityMessage();
+    unsigned long long start = Time::GetMicros();
 
-            msg->entity_id = 0;
-            msg->name = "Kirtah";
-            msg->skin = "yeti";
-            msg->map = "Himalayas";
-            msg->loc.x = -5;
-            msg->loc.y = 0;
+    for (unsigned int tick = 1; tick <= TICKS; tick++)
+        store.Update(tick * FRAME);
 
-            uplink->Send(msg);
-            state = 0;
-        }
-        else if (state == 0 && now - start > 1500)
-        {
-            EntityAppearMessage* msg = new EntityAppearMessage();
+    unsigned long long elapsed = Time::GetMicros() - start;
 
-            msg->entity_id = 1;
-            msg->name = "Zathril";
-            msg->skin = "azlar";
+    std::cout << count << " characters: " << (double)elapsed / TICKS <<
+        " us per tick" << std::endl;
+}
 
-            uplink->Send(msg);
-            state = 3;
-        }
-        else if (state == 3 && now - start > 1700)
-        {
-            EntityActionMessage* msg = new EntityActionMessage();
 
-            msg->entity_id = 1;
-            msg->action_id = 3;
-            msg->action_loc = Point(4,5);
+// Packs count things into a square at about one per four tiles, then
+// times moving them all a tile, and radius, rectangle and nearest queries
+// against the grid and against looking at everything.
+void BenchmarkSpatial(unsigned int count)
+{
+    const unsigned int QUERIES = 1000;
+    const unsigned int RADIUS = 5;
+    const unsigned int NEAREST = 8;
+
+    int side = 1;
+    while ((unsigned int)(side * side) < count * 4)
+        side++;
+
+    SpatialGrid grid;
+    std::vector<Point> locs(count);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        locs[i] = Point(rand() % side, rand() % side);
+        grid.Insert(SlotHandle(i, 1), locs[i]);
+    }
+
+    std::vector<Point> centers(QUERIES);
+    for (auto& c : centers)
+        c = Point(rand() % side, rand() % side);
+
+    std::vector<SlotHandle> found;
+    unsigned long long start = Time::GetMicros();
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        locs[i].x += 1;
+        grid.Move(SlotHandle(i, 1), locs[i]);
+    }
+
+    unsigned long long moves = Time::GetMicros() - start;
+    size_t hits = 0;
+    start = Time::GetMicros();
+
+    for (auto& c : centers)
+    {
+        found.clear();
+        grid.QueryRadius(c, RADIUS, found);
+        hits += found.size();
+    }
 
-            ActionAffectedDetails detail = ActionAffectedDetails();
-            detail.entity_id = 1;
-            detail.hp = 100;
-            msg->affected.push_back(detail);
+    unsigned long long radius = Time::GetMicros() - start;
+    start = Time::GetMicros();
 
-            uplink->Send(msg);
-            state = 4;
+    for (auto& c : centers)
+    {
+        found.clear();
+        grid.QueryRect(Point(c.x - 8, c.y - 8), Point(c.x + 8, c.y + 8),
+                       found);
+    }
+
+    unsigned long long rect = Time::GetMicros() - start;
+    start = Time::GetMicros();
+
+    for (auto& c : centers)
+    {
+        found.clear();
+        grid.QueryNearest(c, NEAREST, found);
+    }
+
+    unsigned long long nearest = Time::GetMicros() - start;
+    size_t scan_hits = 0;
+    start = Time::GetMicros();
+
+    for (auto& c : centers)
+        for (auto& l : locs)
+        {
+            long long dx = l.x - c.x;
+            long long dy = l.y - c.y;
+
+            if (dx * dx + dy * dy <= RADIUS * RADIUS)
+                scan_hits++;
         }
-        else if (state == 4 && now - start > 2300)
+
+    unsigned long long scan = Time::GetMicros() - start;
+
+    if (hits != scan_hits)
+        throw std::runtime_error("Spatial grid missed something.");
+
+    std::cout << count << " entities on " << side << "x" << side <<
+        ": move all " << moves << " us, per query: radius " <<
+        (double)radius / QUERIES << " us, rect " <<
+        (double)rect / QUERIES << " us, nearest " <<
+        (double)nearest / QUERIES << " us, scan " <<
+        (double)scan / QUERIES << " us" << std::endl;
+}
+
+
+// One or more messages of every type, with the awkward values filled in:
+// empty and long strings, negative and large numbers, empty and bent paths
+// and partial deltas.
+void BuildCodecCorpus(std::vector<Message*>& corpus)
+{
+    Path bent;
+    bent.Append(Point(-3, 7));
+    bent.AppendLeg(DIR_EAST, 200);
+    bent.AppendLeg(DIR_SOUTH_WEST, 1);
+    bent.AppendLeg(DIR_NORTH, 3);
+
+    EntityAppearMessage* appear = MessagePool<EntityAppearMessage>::Acquire();
+    appear->entity_id = 7;
+    appear->name = "Zathril";
+    appear->skin = "azlar";
+    appear->loc = Point(-40000, 12);
+    corpus.push_back(appear);
+
+    appear = MessagePool<EntityAppearMessage>::Acquire();
+    appear->entity_id = 0xffffffff;
+    appear->name = std::string(300, 'x');
+    corpus.push_back(appear);
+
+    IdentityMessage* identity = MessagePool<IdentityMessage>::Acquire();
+    identity->entity_id = 1;
+    identity->name = "Kirtah";
+    identity->skin = "yeti";
+    identity->map = "Himalayas";
+    identity->loc = Point(-5, 0);
+    corpus.push_back(identity);
+
+    EntityDisappearMessage* disappear =
+        MessagePool<EntityDisappearMessage>::Acquire();
+    disappear->entity_id = 123456;
+    corpus.push_back(disappear);
+
+    EntityMoveMessage* move = MessagePool<EntityMoveMessage>::Acquire();
+    move->entity_id = 7;
+    move->speed = 150;
+    move->path = bent;
+    corpus.push_back(move);
+
+    move = MessagePool<EntityMoveMessage>::Acquire();
+    move->entity_id = 8;
+    corpus.push_back(move);
+
+    EntityActionMessage* action = MessagePool<EntityActionMessage>::Acquire();
+    action->entity_id = 7;
+    action->action_id = 5;
+    action->skill_id = 70000;
+    action->action_loc = Point(4, -5);
+
+    for (int i = 0; i < 3; i++)
+    {
+        ActionAffectedDetails detail;
+        detail.entity_id = i * 1000;
+        detail.hp = 60 - i * 50;
+        action->affected.push_back(detail);
+    }
+    corpus.push_back(action);
+
+    EntityDeltaMessage* delta = MessagePool<EntityDeltaMessage>::Acquire();
+    delta->entity_id = 7;
+    delta->sequence = 1;
+    delta->fields = FIELD_ALL;
+    delta->state.name = "Zathril";
+    delta->state.skin = "azlar";
+    delta->state.loc = Point(1, 1);
+    delta->state.speed = 175;
+    delta->state.hp = -1;
+    delta->state.path = bent;
+    corpus.push_back(delta);
+
+    delta = MessagePool<EntityDeltaMessage>::Acquire();
+    delta->entity_id = 7;
+    delta->sequence = 300;
+    delta->baseline = 299;
+    delta->fields = FIELD_HP | FIELD_PATH;
+    delta->state.hp = 20;
+    corpus.push_back(delta);
+
+    SnapshotAckMessage* ack = MessagePool<SnapshotAckMessage>::Acquire();
+    ack->sequence = 300;
+    corpus.push_back(ack);
+}
+
+
+// Checks that every message in the corpus decodes to something that
+// encodes to the same bytes, uses all of them, and that every shorter
+// prefix is refused: Decode throws and DecodeFrame waits for more. Then
+// that a varint past 32 bits and a frame past MAX_FRAME_LENGTH throw.
+void CheckCodec()
+{
+    std::vector<Message*> corpus;
+    BuildCodecCorpus(corpus);
+
+    bool covered[MSG_TYPE_COUNT] = { false };
+
+    for (auto& m : corpus)
+    {
+        covered[m->GetType()] = true;
+
+        std::vector<unsigned char> bytes;
+        MessageCodec::Encode(*m, bytes);
+
+        size_t used;
+        Message* decoded = MessageCodec::Decode(&bytes[0], bytes.size(), used);
+
+        std::vector<unsigned char> again;
+        MessageCodec::Encode(*decoded, again);
+        decoded->Release();
+
+        if (used != bytes.size() || again != bytes)
+            throw std::runtime_error("Codec round trip changed a message.");
+
+        for (size_t size = 0; size < bytes.size(); size++)
         {
-            EntityAppearMessage* msg = new EntityAppearMessage();
+            bool refused = false;
 
-            msg->entity_id = 2;
-            msg->name = "Yeti";
-            msg->skin = "yeti";
-            msg->loc.x = 4;
-            msg->loc.y = -2;
+            try
+            {
+                MessageCodec::Decode(&bytes[0], size, used)->Release();
+            }
+            catch (std::runtime_error&)
+            {
+                refused = true;
+            }
 
-            uplink->Send(msg);
-            state = 5;
+            if (!refused)
+                throw std::runtime_error("Codec decoded a truncated message.");
         }
-        else if (state == 5 && now - start > 2500)
+
+        std::vector<unsigned char> frame;
+        MessageCodec::EncodeFrame(*m, frame);
+
+        for (size_t size = 0; size < frame.size(); size++)
+            if (MessageCodec::DecodeFrame(&frame[0], size, used) || used)
+                throw std::runtime_error("Codec decoded a truncated frame.");
+
+        m->Release();
+    }
+
+    for (unsigned int i = 0; i < MSG_TYPE_COUNT; i++)
+        if (!covered[i])
+            throw std::runtime_error("Codec corpus misses a message type.");
+
+    // An ack whose sequence needs 33 bits, and a frame header one byte over
+    // the limit.
+    const unsigned char overflow[] = {
+        MSG_SNAPSHOT_ACK, 0xff, 0xff, 0xff, 0xff, 0x1f
+    };
+    std::vector<unsigned char> oversized;
+    WireWriter(oversized).PutVarint(MessageCodec::MAX_FRAME_LENGTH + 1);
+
+    bool refused[2] = { false, false };
+    size_t used;
+
+    try
+    {
+        MessageCodec::Decode(overflow, sizeof(overflow), used)->Release();
+    }
+    catch (std::runtime_error&)
+    {
+        refused[0] = true;
+    }
+
+    try
+    {
+        if (Message* m = MessageCodec::DecodeFrame(&oversized[0],
+                                                   oversized.size(), used))
+            m->Release();
+    }
+    catch (std::runtime_error&)
+    {
+        refused[1] = true;
+    }
+
+    if (!refused[0] || !refused[1])
+        throw std::runtime_error("Codec accepted an out-of-range length.");
+
+    std::cout << "Codec: " << corpus.size() << " messages round trip, every "
+        "truncation and out-of-range length refused" << std::endl;
+}
+
+
+// Frames count messages, cycling through the corpus, into one buffer and
+// decodes them back, and prints the cost per message each way.
+void BenchmarkCodec(unsigned int count)
+{
+    std::vector<Message*> corpus;
+    BuildCodecCorpus(corpus);
+
+    std::vector<unsigned char> buffer;
+    unsigned long long start = Time::GetMicros();
+
+    for (unsigned int i = 0; i < count; i++)
+        MessageCodec::EncodeFrame(*corpus[i % corpus.size()], buffer);
+
+    unsigned long long encode = Time::GetMicros() - start;
+    size_t offset = 0;
+    size_t consumed;
+    unsigned int decoded = 0;
+    start = Time::GetMicros();
+
+    while (Message* m = MessageCodec::DecodeFrame(
+               &buffer[0] + offset, buffer.size() - offset, consumed))
+    {
+        offset += consumed;
+        decoded++;
+        m->Release();
+    }
+
+    unsigned long long decode = Time::GetMicros() - start;
+
+    for (auto& m : corpus)
+        m->Release();
+
+    if (decoded != count)
+        throw std::runtime_error("Codec benchmark lost messages.");
+
+    std::cout << count << " messages, " << buffer.size() << " bytes: encode " <<
+        (double)encode * 1000 / count << " ns, decode " <<
+        (double)decode * 1000 / count << " ns per message" << std::endl;
+}
+
+
+// The queue MessageQueue replaced: one std::queue behind one mutex, taken
+// on every push and pop. Only kept for --bench-queue to measure against.
+class MutexMessageQueue
+{
+public:
+    void push(Message* data)
+    {
+        boost::mutex::scoped_lock lock(the_mutex);
+        the_queue.push(data);
+        lock.unlock();
+        the_condition_variable.notify_one();
+    }
+
+    Message* try_pop()
+    {
+        boost::mutex::scoped_lock lock(the_mutex);
+
+        if (the_queue.empty())
+            return NULL;
+
+        Message* ret = the_queue.front();
+        the_queue.pop();
+        return ret;
+    }
+private:
+    std::queue<Message*> the_queue;
+    boost::mutex the_mutex;
+    boost::condition_variable the_condition_variable;
+};
+
+
+template <class Queue>
+void ProduceQueueBenchmark(Queue* queue, const std::vector<Message*>* messages,
+                           unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++)
+        queue->push((*messages)[i % messages->size()]);
+}
+
+
+// Pushes count messages, cycling through messages, from a producer thread
+// while this thread pops them one at a time, and returns how many us that
+// took. Checks they all came out, in order.
+template <class Queue>
+unsigned long long TimeQueuePops(Queue& queue,
+                                 const std::vector<Message*>& messages,
+                                 unsigned int count)
+{
+    unsigned long long start = Time::GetMicros();
+    boost::thread producer(&ProduceQueueBenchmark<Queue>,
+                           &queue, &messages, count);
+
+    for (unsigned int received = 0; received < count; )
+        if (Message* m = queue.try_pop())
         {
-            EntityMoveMessage* msg = new EntityMoveMessage();
-
-            msg->entity_id = 1;
-            msg->speed = 150;
-            msg->path.push_back(Point(0,0));
-            msg->path.push_back(Point(1,0));
-            msg->path.push_back(Point(2,0));
-            msg->path.push_back(Point(2,1));
-            msg->path.push_back(Point(2,2));
-            msg->path.push_back(Point(2,3));
-            msg->path.push_back(Point(3,4));
-            msg->path.push_back(Point(4,5));
-
-            uplink->Send(msg);
-            state = 10;
+            if (m != messages[received % messages.size()])
+                throw std::runtime_error("Queue benchmark lost order.");
+
+            received++;
         }
-        else if (state == 10 && now - start > 5000)
-        {
-            EntityActionMessage* msg = new EntityActionMessage();
 
-            msg->entity_id = 1;
-            msg->action_id = 5;
-            msg->action_loc = Point(4,5);
+    producer.join();
 
-            ActionAffectedDetails detail = ActionAffectedDetails();
-            detail.entity_id = 2;
-            detail.hp = 60;
-            msg->affected.push_back(detail);
+    return Time::GetMicros() - start;
+}
 
-            uplink->Send(msg);
-            state = 20;
-        }
-        else if (state == 20 && now - start > 6000)
+
+// As TimeQueuePops, but takes whatever is queued in one drain_into, as
+// Router::Dispatch does.
+unsigned long long TimeQueueDrains(MessageQueue& queue,
+                                   const std::vector<Message*>& messages,
+                                   unsigned int count)
+{
+    std::vector<Message*> batch;
+    unsigned long long start = Time::GetMicros();
+    boost::thread producer(&ProduceQueueBenchmark<MessageQueue>,
+                           &queue, &messages, count);
+
+    for (unsigned int received = 0; received < count; )
+    {
+        batch.clear();
+        queue.drain_into(batch);
+
+        for (auto& m : batch)
+            if (m != messages[received++ % messages.size()])
+                throw std::runtime_error("Queue benchmark lost order.");
+    }
+
+    producer.join();
+
+    return Time::GetMicros() - start;
+}
+
+
+// Sends every entity through appear, move, action and disappear, with snapshot
+// acks in between, through a prioritized queue small enough to spill, and
+// checks each entity's messages come out in the order they went in: popped
+// one at a time, and drained a few at a time under a budget.
+void CheckQueueOrder()
+{
+    const unsigned int ENTITIES = 16;
+    const unsigned char steps[] = {
+        MSG_ENTITY_APPEAR,
+        MSG_ENTITY_MOVE,
+        MSG_ENTITY_ACTION,
+        MSG_ENTITY_DISAPPEAR
+    };
+    const unsigned int STEPS = sizeof(steps) / sizeof(steps[0]);
+
+    for (int drain = 0; drain < 2; drain++)
+    {
+        MessageQueue queue(4, false, true);
+
+        for (unsigned int step = 0; step < STEPS; step++)
         {
-            EntityMoveMessage* msg = new EntityMoveMessage();
-
-            msg->entity_id = 1;
-            msg->speed = 175;
-            msg->path.push_back(Point(4,4));
-            msg->path.push_back(Point(4,3));
-            msg->path.push_back(Point(3,2));
-            msg->path.push_back(Point(2,1));
-            msg->path.push_back(Point(1,1));
-
-            uplink->Send(msg);
-            state = 50;
+            for (unsigned int id = 1; id <= ENTITIES; id++)
+            {
+                EntityMessage* m;
+
+                switch (steps[step])
+                {
+                case MSG_ENTITY_APPEAR:
+                    m = MessagePool<EntityAppearMessage>::Acquire();
+                    break;
+                case MSG_ENTITY_MOVE:
+                    m = MessagePool<EntityMoveMessage>::Acquire();
+                    break;
+                case MSG_ENTITY_ACTION:
+                    m = MessagePool<EntityActionMessage>::Acquire();
+                    break;
+                default:
+                    m = MessagePool<EntityDisappearMessage>::Acquire();
+                }
+
+                m->entity_id = id;
+                queue.push(m);
+            }
+
+            queue.push(MessagePool<SnapshotAckMessage>::Acquire());
         }
-        else if (state == 50 && now - start > 6500)
+
+        unsigned int next[ENTITIES + 1] = { 0 };
+        std::vector<Message*> batch;
+
+        while (!queue.empty())
         {
-            EntityActionMessage* msg = new EntityActionMessage();
+            batch.clear();
 
-            msg->entity_id = 1;
-            msg->action_id = 5;
-            msg->action_loc = Point(4,5);
+            if (drain)
+                queue.drain_into(batch, 5);
+            else
+                batch.push_back(queue.try_pop());
 
-            ActionAffectedDetails detail = ActionAffectedDetails();
-            detail.entity_id = 2;
-            detail.hp = 20;
-            msg->affected.push_back(detail);
+            for (auto& m : batch)
+            {
+                if (m->GetType() != MSG_SNAPSHOT_ACK)
+                {
+                    unsigned int id =
+                        static_cast<EntityMessage*>(m)->entity_id;
 
-            uplink->Send(msg);
-            state = 100;
-        }
-        else if (state == 100 && now - start > 9000)
-        {
-            EntityDisappearMessage* msg = new EntityDisappearMessage();
+                    if (next[id] == STEPS || m->GetType() != steps[next[id]])
+                        throw std::runtime_error(
+                                "Queue reordered an entity's messages.");
 
-            msg->entity_id = 1;
+                    next[id]++;
+                }
 
-            uplink->Send(msg);
-            state = 101;
+                m->Release();
+            }
         }
-        else if (state == 101 && now - start > 10000)
-        {
-            EntityDisappearMessage* msg = new EntityDisappearMessage();
 
-            msg->entity_id = 2;
+        for (unsigned int id = 1; id <= ENTITIES; id++)
+            if (next[id] != STEPS)
+                throw std::runtime_error("Queue lost an entity's messages.");
+    }
 
-            uplink->Send(msg);
-            state = 500;
-        }
-        else if (state == 500 && now - start > 12000)
-        {
-            start = Time::GetNow();
-            state = 0;
-        }
+    std::cout << "Queue: appear, move, action and disappear stay in order "
+        "for every entity" << std::endl;
+}
+
+
+// Passes count messages from one producer thread to one consumer through
+// the old mutex queue and through MessageQueue, popping one at a time and
+// draining in batches, and prints the cost per message of each.
+void BenchmarkQueue(unsigned int count)
+{
+    const unsigned int MESSAGES = 1024;
+
+    std::vector<Message*> messages;
+
+    for (unsigned int i = 0; i < MESSAGES; i++)
+    {
+        EntityMoveMessage* m = MessagePool<EntityMoveMessage>::Acquire();
+        m->entity_id = i;
+        messages.push_back(m);
     }
-private:
-    Endpoint* uplink;
-    unsigned int start = Time::GetNow();
-};
+
+    MutexMessageQueue mutex_queue;
+    MessageQueue pop_queue;
+    MessageQueue drain_queue;
+
+    unsigned long long mutex = TimeQueuePops(mutex_queue, messages, count);
+    unsigned long long pop = TimeQueuePops(pop_queue, messages, count);
+    unsigned long long drain = TimeQueueDrains(drain_queue, messages, count);
+
+    for (auto& m : messages)
+        m->Release();
+
+    std::cout << count << " messages: mutex queue " <<
+        (double)mutex * 1000 / count << " ns, MessageQueue try_pop " <<
+        (double)pop * 1000 / count << " ns, drain_into " <<
+        (double)drain * 1000 / count << " ns per message" << std::endl;
+}
 
 
 class ClientComm
@@ -251,131 +724,530 @@ public:
         : game_engine(game_engine),
           game_endpoint(game_endpoint),
           graphics_engine(graphics_engine),
-          asset_manager(asset_manager)
+          asset_manager(asset_manager),
+          tracer(NULL)
     {
+        handlers[MSG_ENTITY_APPEAR] = &ClientComm::HandleEntityAppear;
+        handlers[MSG_IDENTITY] = &ClientComm::HandleIdentity;
+        handlers[MSG_ENTITY_DISAPPEAR] = &ClientComm::HandleEntityDisappear;
+        handlers[MSG_ENTITY_MOVE] = &ClientComm::HandleEntityMove;
+        handlers[MSG_ENTITY_ACTION] = &ClientComm::HandleEntityAction;
+        handlers[MSG_ENTITY_DELTA] = &ClientComm::HandleEntityDelta;
+        handlers[MSG_SNAPSHOT_ACK] = &ClientComm::HandleUnexpected;
     }
 
     void Update()
     {
-        while (Message* msg = game_endpoint.Poll())
+        inbox.clear();
+        game_endpoint.PollAll(inbox);
+        coalescer.Coalesce(inbox);
+
+        for (auto& msg : inbox)
             Handle(msg);
 
+        unsigned int sequence;
+        if (snapshots.TakeAck(sequence))
+        {
+            SnapshotAckMessage* ack =
+                MessagePool<SnapshotAckMessage>::Acquire();
+            ack->sequence = sequence;
+            game_endpoint.Send(ack);
+        }
+
         //while (Message* msg = graphics_endpoint.Poll())
             //Handle(msg);
     }
 
+    inline MessageCoalescer const& GetCoalescer() const { return coalescer; }
+    inline SnapshotClient const& GetSnapshots() const { return snapshots; }
+
+    inline void SetTracer(LatencyTracer* tracer) { this->tracer = tracer; }
+
+    // Routes each message to exactly one handler by its type tag.
     void Handle(Message* msg)
     {
-        if (EntityAppearMessage* m =
-            dynamic_cast<EntityAppearMessage*>(msg))
-        {
-            std::cout << "EntityAppearMessage: " << m->name << std::endl;
+        if (tracer)
+            tracer->OnHandled(*msg);
 
-            Character* character = new Character();
-            character->SetID(m->entity_id);
-            character->SetName(m->name);
-            character->SetLoc(m->loc);
+        (this->*handlers[msg->GetType()])(msg);
 
-            game_engine.Register(character);
+        msg->Release();
+    }
+protected:
+    typedef void (ClientComm::*Handler)(Message*);
 
-            YetiComponent* component = new YetiComponent(
-                asset_manager,
-                *character,
-                m->skin
-            );
+    void HandleEntityAppear(Message* msg)
+    {
+        EntityAppearMessage* m = static_cast<EntityAppearMessage*>(msg);
 
-            graphics_engine.Register(component);
-        }
+        if (game_engine.TryGetEntityByID(m->entity_id))
+            return;
 
-        if (IdentityMessage* m =
-            dynamic_cast<IdentityMessage*>(msg))
-        {
-            std::cout << "IdentityMessage: " << m->name << std::endl;
+        Character* character = new Character(game_engine.GetCharacterStore());
+        character->SetID(m->entity_id);
+        character->SetName(m->name);
+        character->SetLoc(m->loc);
 
-            Entity* entity = game_engine.GetEntityByID(m->entity_id);
-            Character* character = dynamic_cast<Character*>(entity);
-            game_engine.SetAvatar(character);
-        }
+        game_engine.Register(character);
 
-        if (EntityDisappearMessage* m =
-            dynamic_cast<EntityDisappearMessage*>(msg))
-        {
-            std::cout << "EntityDisappearMessage: " << m->entity_id <<
-                std::endl;
+        YetiComponent* component = new YetiComponent(
+            asset_manager,
+            game_engine,
+            *character,
+            m->skin
+        );
+
+        graphics_engine.Register(component, character);
+    }
+
+    void HandleIdentity(Message* msg)
+    {
+        IdentityMessage* m = static_cast<IdentityMessage*>(msg);
+
+        // The avatar is a regular entity that happens to be us.
+        HandleEntityAppear(msg);
+
+        Entity* entity = game_engine.GetEntityByID(m->entity_id);
+        Character* character = dynamic_cast<Character*>(entity);
+        game_engine.SetAvatar(character);
+    }
+
+    void HandleEntityDisappear(Message* msg)
+    {
+        EntityDisappearMessage* m = static_cast<EntityDisappearMessage*>(msg);
 
-            Entity* entity = game_engine.GetEntityByID(m->entity_id);
-            Component* component = graphics_engine.FindComponent(entity);
+        snapshots.Forget(m->entity_id);
 
+        // A bounded queue may have dropped the appear; see QUEUE_POLICY.
+        Entity* entity = game_engine.TryGetEntityByID(m->entity_id);
+        if (!entity)
+            return;
+
+        // Actions still naming the entity find its handle stale.
+        Component* component = graphics_engine.FindComponent(entity);
+
+        if (component)
             graphics_engine.Deregister(component);
-            game_engine.Deregister(entity);
+        game_engine.Deregister(entity);
 
-            delete component;
-            delete entity;
-        }
+        delete component;
+        delete entity;
+    }
+
+    void HandleEntityMove(Message* msg)
+    {
+        EntityMoveMessage* m = static_cast<EntityMoveMessage*>(msg);
+
+        Entity* entity = game_engine.TryGetEntityByID(m->entity_id);
+        if (!entity)
+            return;
+
+        Character* character = dynamic_cast<Character*>(entity);
+        if (!character)
+            throw std::runtime_error(
+                    "Failed to cast Entity to Character.");
 
-        if (EntityMoveMessage* m =
-            dynamic_cast<EntityMoveMessage*>(msg))
+        character->SetPath(m->path);
+
+        character->SetSpeed(m->speed);
+    }
+
+    void HandleEntityAction(Message* msg)
+    {
+        EntityActionMessage* m = static_cast<EntityActionMessage*>(msg);
+
+        Entity* entity = game_engine.TryGetEntityByID(m->entity_id);
+        if (!entity)
+            return;
+
+        Character* character = dynamic_cast<Character*>(entity);
+        if (!character)
+            throw std::runtime_error(
+                    "Failed to cast Entity to Character.");
+
+        Skill skill;
+
+        SkillAction* action = new SkillAction(character->GetHandle(), skill);
+
+        for (auto& t : m->affected)
         {
-            std::cout << "EntityMoveMessage: " << m->entity_id << std::endl;
+            Entity* t_ent = game_engine.TryGetEntityByID(t.entity_id);
+            if (!t_ent)
+                continue;
 
-            Entity* entity = game_engine.GetEntityByID(m->entity_id);
-            Character* character = dynamic_cast<Character*>(entity);
-            if (!character)
+            Character* t_char = dynamic_cast<Character*>(t_ent);
+            if (!t_char)
                 throw std::runtime_error(
                         "Failed to cast Entity to Character.");
 
-            character->ClearPath();
-
-            for (auto& p : m->path)
-                character->QueuePath(p);
+            t_char->SetHP(t.hp);
 
-            character->SetSpeed(m->speed);
+            action->GetTargetsMutable().push_back(t_char->GetHandle());
         }
 
-        if (EntityActionMessage* m =
-            dynamic_cast<EntityActionMessage*>(msg))
-        {
-            std::cout << "EntityActionMessage: " << m->entity_id << std::endl;
+        game_engine.Register(*action);
+    }
 
-            Entity* entity = game_engine.GetEntityByID(m->entity_id);
-            Character* character = dynamic_cast<Character*>(entity);
+    // Snapshot mode: the first state seen for an entity brings it in, later
+    // ones update only the fields that changed.
+    void HandleEntityDelta(Message* msg)
+    {
+        EntityDeltaMessage* m = static_cast<EntityDeltaMessage*>(msg);
 
-            Skill skill;
+        bool created;
+        const EntityState* state = snapshots.Apply(*m, created);
+        if (!state)
+            return;
 
-            SkillAction* action = new SkillAction(*character, skill);
+        unsigned char fields = created ? (unsigned char)FIELD_ALL : m->fields;
+        Character* character;
 
-            for (auto& t : m->affected)
-            {
-                Entity* t_ent = game_engine.GetEntityByID(t.entity_id);
-                Character* t_char = dynamic_cast<Character*>(t_ent);
+        // A full state for an entity we already have (say, after a resync)
+        // just updates it.
+        Entity* entity = game_engine.TryGetEntityByID(m->entity_id);
 
-                t_char->SetHP(t.hp);
+        if (!entity)
+        {
+            if (!created)
+                return;
 
-                action->GetTargetsMutable().push_back(t_char);
-            }
+            character = new Character(game_engine.GetCharacterStore());
+            character->SetID(m->entity_id);
+            game_engine.Register(character);
+
+            YetiComponent* component = new YetiComponent(
+                asset_manager,
+                game_engine,
+                *character,
+                state->skin
+            );
 
-            game_engine.Register(*action);
+            graphics_engine.Register(component, character);
+        }
+        else
+        {
+            character = dynamic_cast<Character*>(entity);
+            if (!character)
+                throw std::runtime_error(
+                        "Failed to cast Entity to Character.");
         }
 
-        delete msg;
+        if (fields & FIELD_NAME)
+            character->SetName(state->name);
+        if (fields & FIELD_LOC)
+            character->SetLoc(state->loc);
+        if (fields & FIELD_SPEED)
+            character->SetSpeed(state->speed);
+        if (fields & FIELD_HP)
+            character->SetHP(state->hp);
+
+        if (fields & FIELD_PATH)
+            character->SetPath(state->path);
+    }
+
+    // For types that only ever travel towards the server.
+    void HandleUnexpected(Message* msg)
+    {
+        std::cout << "Unexpected message type: " << (int)msg->GetType() <<
+            std::endl;
     }
 private:
     GameEngine& game_engine;
     GraphicsEngine& graphics_engine;
 
     Endpoint& game_endpoint;
+    std::vector<Message*> inbox;
+    MessageCoalescer coalescer;
+    SnapshotClient snapshots;
 
     AssetManager& asset_manager;
+    LatencyTracer* tracer;
+
+    Handler handlers[MSG_TYPE_COUNT];
+};
+
+
+// Subscribes to every topic and counts what goes past, for a summary at
+// exit. It only looks at the messages, which other subscribers share.
+class MessageLog
+{
+public:
+    MessageLog(Router& router, Endpoint& endpoint)
+        : router(router),
+          endpoint(endpoint)
+    {
+        for (int topic = 0; topic < MSG_TYPE_COUNT; topic++)
+        {
+            router.Subscribe(topic, ADDR_LOGGER);
+            counts[topic] = 0;
+        }
+    }
+
+    void Update()
+    {
+        inbox.clear();
+        endpoint.PollAll(inbox);
+
+        for (auto& msg : inbox)
+        {
+            counts[msg->GetType()]++;
+            msg->Release();
+        }
+    }
+
+    void Print() const
+    {
+        std::cout << "Messages by type:";
+
+        for (int topic = 0; topic < MSG_TYPE_COUNT; topic++)
+            std::cout << " " << counts[topic];
+
+        unsigned long drops = 0;
+
+        for (int lane = 0; lane < LANE_COUNT; lane++)
+            drops += router.GetOutboundLaneStats(ADDR_LOGGER, lane).drops;
+
+        std::cout << " (" << drops << " dropped)" << std::endl;
+    }
+private:
+    Router& router;
+    Endpoint& endpoint;
+    std::vector<Message*> inbox;
+
+    unsigned long counts[MSG_TYPE_COUNT];
 };
 
 
-int main()
+int main(int argc, char* argv[])
 {
+    // --loopback runs the simulated server behind a real TCP connection on
+    // 127.0.0.1 instead of feeding the router directly. --loopback-udp
+    // [loss] [latency_ms] [jitter_ms] does the same over UDP, optionally
+    // through an impaired link.
+    //
+    // --shm maps a shared-memory uplink for a separate process started with
+    // --shm-server, which runs only the simulated server.
+    //
+    // --replay <file> [fast] plays a recorded session back in place of the
+    // server, either in real time or one recorded batch per frame. Any of
+    // the others can be followed by --record <file> to capture everything
+    // the router moves, --log to count every message by type and/or
+    // --trace to print how long each type takes to reach the screen.
+    //
+    // --scenario <file> makes the simulated server play that scenario (see
+    // scenario.h) instead of the built-in demo, and --snapshots makes it
+    // replicate entities as snapshot deltas instead of appear and move
+    // messages.
+    //
+    // --bench-characters [count] ... times character movement and exits.
+    //
+    // --bench-spatial [count] ... times spatial grid updates and queries
+    // and exits.
+    //
+    // --bench-codec [count] ... checks that every message type survives the
+    // codec, times encoding and decoding, and exits.
+    //
+    // --bench-queue [count] ... checks that the queue keeps each entity's
+    // messages in order, times passing messages from one thread to another
+    // through MessageQueue and through the mutex queue it replaced, and
+    // exits.
+    std::string mode = argc > 1 ? argv[1] : "";
+
+    const char* record_path = NULL;
+    const char* scenario_path = NULL;
+    bool log = false;
+    bool trace = false;
+    bool snapshots = false;
+
+    for (int i = argc - 1; i > 0; i--)
+        if (std::string(argv[i]) == "--log")
+        {
+            log = true;
+            argc = i;
+        }
+        else if (std::string(argv[i]) == "--trace")
+        {
+            trace = true;
+            argc = i;
+        }
+        else if (std::string(argv[i]) == "--snapshots")
+        {
+            snapshots = true;
+            argc = i;
+        }
+        else if (std::string(argv[i]) == "--record" && i + 1 < argc)
+        {
+            record_path = argv[i + 1];
+            argc = i;
+        }
+        else if (std::string(argv[i]) == "--scenario" && i + 1 < argc)
+        {
+            scenario_path = argv[i + 1];
+            argc = i;
+        }
+
+    // Stamps go on as messages are acquired, so before the first one is.
+    Message::SetTracing(trace);
+
+    if (mode == "--bench-characters")
+    {
+        if (argc < 3)
+        {
+            BenchmarkCharacters(10000);
+            BenchmarkCharacters(100000);
+        }
+
+        for (int i = 2; i < argc; i++)
+            BenchmarkCharacters(atoi(argv[i]));
+
+        return 0;
+    }
+
+    if (mode == "--bench-spatial")
+    {
+        if (argc < 3)
+        {
+            BenchmarkSpatial(10000);
+            BenchmarkSpatial(100000);
+        }
+
+        for (int i = 2; i < argc; i++)
+            BenchmarkSpatial(atoi(argv[i]));
+
+        return 0;
+    }
+
+    if (mode == "--bench-codec")
+    {
+        CheckCodec();
+
+        if (argc < 3)
+        {
+            BenchmarkCodec(100000);
+            BenchmarkCodec(1000000);
+        }
+
+        for (int i = 2; i < argc; i++)
+            BenchmarkCodec(atoi(argv[i]));
+
+        return 0;
+    }
+
+    if (mode == "--bench-queue")
+    {
+        CheckQueueOrder();
+
+        if (argc < 3)
+        {
+            BenchmarkQueue(100000);
+            BenchmarkQueue(1000000);
+        }
+
+        for (int i = 2; i < argc; i++)
+            BenchmarkQueue(atoi(argv[i]));
+
+        return 0;
+    }
+
+    if (mode == "--shm-server")
+    {
+        EndpointPair endpoints;
+        ShmTransport transport(
+            endpoints.GetTransportEndpoint(),
+            SHM_UPLINK_NAME,
+            false
+        );
+
+        Time::UpdateNow();
+        ScenarioRuntime* server_sim = CreateServerSimulator(
+            endpoints.GetScriptEndpoint(),
+            scenario_path,
+            snapshots
+        );
+
+        while (true)
+        {
+            Time::UpdateNow();
+            server_sim->Update();
+            transport.Update();
+
+            if (!transport.IsConnected())
+                return 1;
+
+            transport.WaitForInput(1);
+        }
+    }
+
     Router router;
 
     Endpoint& uplink = router.Register(ADDR_UPLINK);
     Endpoint& game_endpoint = router.Register(ADDR_GAME_ENGINE);
 
+    Endpoint* server_endpoint = &uplink;
+
+    LoopbackServer* loopback_server = NULL;
+    TcpUplink* tcp_uplink = NULL;
+    UdpLoopbackServer* udp_server = NULL;
+    UdpUplink* udp_uplink = NULL;
+    ShmTransport* shm_transport = NULL;
+    LogPlayer* log_player = NULL;
+    Recorder* recorder = NULL;
+
+    if (mode == "--loopback")
+    {
+        loopback_server = new LoopbackServer();
+        tcp_uplink = new TcpUplink(
+            uplink,
+            "127.0.0.1",
+            loopback_server->GetPort()
+        );
+        server_endpoint = &loopback_server->GetScriptEndpoint();
+    }
+    else if (mode == "--loopback-udp")
+    {
+        LinkConditions conditions(
+            argc > 2 ? atof(argv[2]) : 0.0,
+            argc > 3 ? atoi(argv[3]) : 0,
+            argc > 4 ? atoi(argv[4]) : 0
+        );
+
+        udp_server = new UdpLoopbackServer(conditions);
+        udp_uplink = new UdpUplink(
+            uplink,
+            "127.0.0.1",
+            udp_server->GetPort(),
+            conditions
+        );
+        server_endpoint = &udp_server->GetScriptEndpoint();
+    }
+    else if (mode == "--shm")
+    {
+        shm_transport = new ShmTransport(uplink, SHM_UPLINK_NAME, true);
+        server_endpoint = NULL;
+    }
+    else if (mode == "--replay" && argc > 2)
+    {
+        bool realtime = !(argc > 3 && std::string(argv[3]) == "fast");
+
+        log_player = new LogPlayer(uplink, argv[2], realtime);
+        server_endpoint = NULL;
+    }
+
+    if (record_path)
+    {
+        recorder = new Recorder(record_path);
+        router.SetTap(recorder);
+    }
+
+    MessageLog* message_log = NULL;
+
+    // The log is only for looking at; it never gets to hold up the game or
+    // grow without limit.
+    if (log)
+        message_log = new MessageLog(router, router.Register(
+            ADDR_LOGGER, false, QueueOptions(MessageQueue::DEFAULT_CAPACITY,
+                                             QUEUE_DROP_NEWEST, 4096)));
+
     GameEngine game_engine(game_endpoint);
     GraphicsEngine graphics_engine(game_engine);
 
@@ -384,7 +1256,11 @@ int main()
     asset_manager.GetTexture("azlar.png")->SetOffset(Point(0,28));
     asset_manager.RegisterMesh("square", temp_gen_mesh());
 
-    ServerSimulator server_sim(&uplink);
+    ScenarioRuntime* server_sim = NULL;
+
+    if (server_endpoint)
+        server_sim = CreateServerSimulator(*server_endpoint, scenario_path,
+                                           snapshots);
 
     ClientComm client_comm(
         game_engine,
@@ -393,18 +1269,66 @@ int main()
         asset_manager
     );
 
+    LatencyTracer* tracer = NULL;
+
+    if (trace)
+    {
+        tracer = new LatencyTracer();
+        client_comm.SetTracer(tracer);
+    }
+
     while (true)
     {
-        server_sim.Update();
+        if (server_sim)
+            server_sim->Update();
+
+        if (loopback_server)
+            loopback_server->Flush();
+
+        if (shm_transport)
+            shm_transport->Update();
+
+        if (log_player)
+            log_player->Update();
+
         client_comm.Update();
 
+        if (message_log)
+            message_log->Update();
+
         if (!temp_process_input(game_engine.GetAvatar()))
             break;
 
         router.Dispatch();
+
+        if (tcp_uplink)
+            tcp_uplink->Flush();
+
         game_engine.Update();
         graphics_engine.Draw();
+
+        if (tracer)
+            tracer->OnFrame();
     }
 
+    delete server_sim;
+    delete tcp_uplink;
+    delete loopback_server;
+    delete udp_uplink;
+    delete udp_server;
+    delete shm_transport;
+    delete log_player;
+
+    router.SetTap(NULL);
+    delete recorder;
+
+    if (message_log)
+        message_log->Print();
+    delete message_log;
+
+    if (tracer)
+        tracer->Report(std::cout);
+    delete tracer;
+
     return 0;
 }
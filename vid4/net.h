@@ -0,0 +1,412 @@
+#ifndef NET_H
+#define NET_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "comm.h"
+#include "codec.h"
+
+
+struct TransportStats
+{
+    unsigned long frames_in;
+    unsigned long frames_out;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+
+    // Frames that failed to decode or were longer than
+    // MessageCodec::MAX_FRAME_LENGTH; each one closes the connection.
+    unsigned long malformed;
+};
+
+
+// Carries an Endpoint over a TCP socket. All socket I/O happens on the
+// transport's own thread: frames read from the socket are decoded and Sent
+// into the endpoint, and whatever can be Polled from the endpoint is encoded
+// and written out. The I/O thread is the only consumer of the endpoint's
+// input queue, so the queue's single-consumer contract holds.
+//
+// Whoever feeds the endpoint calls Flush() once it has queued something;
+// the I/O thread does not wake up to look on its own while the endpoint is
+// empty.
+class TcpTransport
+{
+public:
+    TcpTransport(Endpoint& endpoint)
+        : socket(io),
+          endpoint(endpoint),
+          flush_timer(io),
+          writing(false),
+          flush_armed(false),
+          connected(false),
+          frames_in(0),
+          frames_out(0),
+          bytes_in(0),
+          bytes_out(0),
+          malformed(0)
+    { }
+
+    virtual ~TcpTransport()
+    {
+        Stop();
+
+        for (auto& m : outbox)
+            m->Release();
+    }
+
+    void Stop()
+    {
+        io.stop();
+
+        if (thread.joinable())
+            thread.join();
+
+        boost::system::error_code ignored;
+        socket.close(ignored);
+        connected = false;
+    }
+
+    // Asks the I/O thread to send whatever is waiting. Safe to call from
+    // any thread.
+    void Flush()
+    {
+        io.post(boost::bind(&TcpTransport::DoFlush, this));
+    }
+
+    inline bool IsConnected() const { return connected; }
+
+    TransportStats GetStats() const
+    {
+        TransportStats ret;
+        ret.frames_in = frames_in;
+        ret.frames_out = frames_out;
+        ret.bytes_in = bytes_in;
+        ret.bytes_out = bytes_out;
+        ret.malformed = malformed;
+        return ret;
+    }
+protected:
+    // How soon the I/O thread looks at the endpoint again when messages
+    // arrived while it was flushing.
+    enum { FLUSH_INTERVAL_MS = 1, READ_CHUNK = 16 * 1024 };
+
+    void Start()
+    {
+        thread = boost::thread(
+            boost::bind(&boost::asio::io_service::run, &io));
+    }
+
+    // Runs on the I/O thread once the socket is connected.
+    void OnConnected()
+    {
+        socket.set_option(boost::asio::ip::tcp::no_delay(true));
+        connected = true;
+
+        StartRead();
+        DoFlush();
+    }
+
+    boost::asio::io_service io;
+    boost::asio::ip::tcp::socket socket;
+private:
+    void StartRead()
+    {
+        size_t used = read_buffer.size();
+        read_buffer.resize(used + READ_CHUNK);
+
+        socket.async_read_some(
+            boost::asio::buffer(&read_buffer[used], READ_CHUNK),
+            boost::bind(&TcpTransport::OnRead, this,
+                        boost::asio::placeholders::error,
+                        boost::asio::placeholders::bytes_transferred,
+                        used));
+    }
+
+    void OnRead(const boost::system::error_code& error, size_t bytes,
+                size_t used)
+    {
+        read_buffer.resize(used + bytes);
+
+        if (error)
+        {
+            OnError(error);
+            return;
+        }
+
+        bytes_in += bytes;
+
+        inbox.clear();
+
+        size_t offset = 0;
+        size_t consumed;
+        bool bad = false;
+
+        try
+        {
+            while (Message* m = MessageCodec::DecodeFrame(
+                       &read_buffer[0] + offset,
+                       read_buffer.size() - offset,
+                       consumed))
+            {
+                inbox.push_back(m);
+                offset += consumed;
+            }
+        }
+        catch (std::runtime_error& e)
+        {
+            std::cout << "Malformed frame: " << e.what() << std::endl;
+            malformed++;
+            bad = true;
+        }
+
+        read_buffer.erase(read_buffer.begin(), read_buffer.begin() + offset);
+
+        // Whatever was decoded before a bad frame is still good.
+        frames_in += inbox.size();
+        endpoint.SendAll(inbox);
+
+        // There is no telling where the next frame starts.
+        if (bad)
+        {
+            Close();
+            return;
+        }
+
+        StartRead();
+    }
+
+    void StartFlushTimer()
+    {
+        if (flush_armed)
+            return;
+
+        flush_armed = true;
+        flush_timer.expires_from_now(
+            boost::asio::chrono::milliseconds(FLUSH_INTERVAL_MS));
+
+        flush_timer.async_wait(
+            boost::bind(&TcpTransport::OnFlushTimer, this,
+                        boost::asio::placeholders::error));
+    }
+
+    void OnFlushTimer(const boost::system::error_code& error)
+    {
+        flush_armed = false;
+
+        if (error)
+            return;
+
+        DoFlush();
+    }
+
+    void DoFlush()
+    {
+        if (!connected)
+            return;
+
+        outbox.clear();
+        endpoint.PollAll(outbox);
+
+        for (auto& m : outbox)
+        {
+            try
+            {
+                MessageCodec::EncodeFrame(*m, pending);
+                frames_out++;
+            }
+            catch (std::runtime_error& e)
+            {
+                std::cout << "Dropped outgoing message: " << e.what() <<
+                    std::endl;
+            }
+
+            m->Release();
+        }
+
+        outbox.clear();
+
+        StartWrite();
+
+        // A producer may have queued more since the poll, before or after
+        // its Flush() was posted; look again shortly rather than miss it.
+        if (endpoint.HasInput())
+            StartFlushTimer();
+    }
+
+    // Only one write is in flight at a time; anything encoded meanwhile
+    // collects in pending and goes out as a single write afterwards.
+    void StartWrite()
+    {
+        if (writing || pending.empty())
+            return;
+
+        writing = true;
+        in_flight.swap(pending);
+
+        boost::asio::async_write(
+            socket,
+            boost::asio::buffer(in_flight),
+            boost::bind(&TcpTransport::OnWrite, this,
+                        boost::asio::placeholders::error,
+                        boost::asio::placeholders::bytes_transferred));
+    }
+
+    void OnWrite(const boost::system::error_code& error, size_t bytes)
+    {
+        writing = false;
+        in_flight.clear();
+
+        if (error)
+        {
+            OnError(error);
+            return;
+        }
+
+        bytes_out += bytes;
+        StartWrite();
+    }
+
+    void OnError(const boost::system::error_code& error)
+    {
+        if (error == boost::asio::error::operation_aborted)
+            return;
+
+        std::cout << "Transport disconnected: " << error.message() <<
+            std::endl;
+
+        Close();
+    }
+
+    void Close()
+    {
+        connected = false;
+        flush_timer.cancel();
+
+        boost::system::error_code ignored;
+        socket.close(ignored);
+    }
+
+    Endpoint& endpoint;
+
+    boost::asio::steady_timer flush_timer;
+    boost::thread thread;
+
+    std::vector<unsigned char> read_buffer;
+    std::vector<unsigned char> pending;
+    std::vector<unsigned char> in_flight;
+    std::vector<Message*> inbox;
+    std::vector<Message*> outbox;
+
+    bool writing;
+    bool flush_armed;
+    std::atomic<bool> connected;
+
+    std::atomic<unsigned long> frames_in;
+    std::atomic<unsigned long> frames_out;
+    std::atomic<unsigned long> bytes_in;
+    std::atomic<unsigned long> bytes_out;
+    std::atomic<unsigned long> malformed;
+};
+
+
+// Network-backed uplink: connects to the server and carries the endpoint
+// returned by Router::Register(ADDR_UPLINK) over the connection.
+class TcpUplink : public TcpTransport
+{
+public:
+    TcpUplink(Endpoint& uplink, const std::string& host,
+              unsigned short port)
+        : TcpTransport(uplink)
+    {
+        boost::asio::ip::tcp::resolver resolver(io);
+        boost::asio::ip::tcp::resolver::query query(
+            host, std::to_string(port));
+
+        boost::asio::connect(socket, resolver.resolve(query));
+
+        OnConnected();
+        Start();
+    }
+};
+
+
+// Two queues joined back to back: whatever is sent on one endpoint is polled
+// from the other. Used to give a transport and a local script (such as a
+// ServerSimulator) each their own side of a connection. Transports inherit
+// it ahead of their transport base so the queues exist before the transport
+// is constructed around them.
+class EndpointPair
+{
+public:
+    EndpointPair()
+        : transport_endpoint(from_script, to_script),
+          script_endpoint(to_script, from_script)
+    { }
+
+    inline Endpoint& GetTransportEndpoint() { return transport_endpoint; }
+    inline Endpoint& GetScriptEndpoint() { return script_endpoint; }
+private:
+    MessageQueue from_script;
+    MessageQueue to_script;
+
+    Endpoint transport_endpoint;
+    Endpoint script_endpoint;
+};
+
+
+// Stand-in server on 127.0.0.1 for measuring the uplink without an external
+// service. Whatever is sent through GetScriptEndpoint() (for instance by a
+// ServerSimulator) goes out to the connected client, and whatever the client
+// sends can be polled from it.
+class LoopbackServer : private EndpointPair, public TcpTransport
+{
+public:
+    LoopbackServer(unsigned short port = 0)
+        : TcpTransport(GetTransportEndpoint()),
+          acceptor(io, boost::asio::ip::tcp::endpoint(
+              boost::asio::ip::address_v4::loopback(), port))
+    {
+        acceptor.async_accept(
+            socket,
+            boost::bind(&LoopbackServer::OnAccept, this,
+                        boost::asio::placeholders::error));
+
+        Start();
+    }
+
+    virtual ~LoopbackServer()
+    {
+        Stop();
+    }
+
+    inline unsigned short GetPort() const
+    {
+        return acceptor.local_endpoint().port();
+    }
+
+    using EndpointPair::GetScriptEndpoint;
+private:
+    void OnAccept(const boost::system::error_code& error)
+    {
+        if (error)
+        {
+            std::cout << "Loopback accept failed: " << error.message() <<
+                std::endl;
+            return;
+        }
+
+        OnConnected();
+    }
+
+    boost::asio::ip::tcp::acceptor acceptor;
+};
+
+#endif
@@ -0,0 +1,326 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <vector>
+#include <algorithm>
+
+#include "common.h"
+#include "inlinering.h"
+
+
+// The eight neighbouring tiles, clockwise from up (y - 1).
+enum DIRECTION {
+    DIR_NORTH,
+    DIR_NORTH_EAST,
+    DIR_EAST,
+    DIR_SOUTH_EAST,
+    DIR_SOUTH,
+    DIR_SOUTH_WEST,
+    DIR_WEST,
+    DIR_NORTH_WEST,
+
+    DIR_COUNT
+};
+
+
+// Offset of one step in a direction.
+inline Point DirectionStep(int direction)
+{
+    static const Point steps[DIR_COUNT] = {
+        Point(0, -1), Point(1, -1), Point(1, 0), Point(1, 1),
+        Point(0, 1), Point(-1, 1), Point(-1, 0), Point(-1, -1)
+    };
+
+    return steps[direction];
+}
+
+
+// Direction of a step to a neighbouring tile, or -1 if to is not one.
+inline int DirectionOf(const Point& from, const Point& to)
+{
+    int dx = to.x - from.x;
+    int dy = to.y - from.y;
+
+    if (dx < -1 || dx > 1 || dy < -1 || dy > 1 || (!dx && !dy))
+        return -1;
+
+    static const int directions[3][3] = {
+        { DIR_NORTH_WEST, DIR_WEST, DIR_SOUTH_WEST },
+        { DIR_NORTH, -1, DIR_SOUTH },
+        { DIR_NORTH_EAST, DIR_EAST, DIR_SOUTH_EAST }
+    };
+
+    return directions[dx + 1][dy + 1];
+}
+
+
+// Some number of steps in the same direction.
+struct PathLeg
+{
+    PathLeg(unsigned char direction = DIR_NORTH, unsigned int tiles = 0)
+        : direction(direction), tiles(tiles) { }
+
+    inline bool operator==(const PathLeg& o) const
+    {
+        return direction == o.direction && tiles == o.tiles;
+    }
+
+    unsigned char direction;
+    unsigned int tiles;
+};
+
+
+// A path to walk, as the first tile to step onto and the straight legs
+// after it: "2,0, then 3 east, then 2 south" rather than six tiles. Long
+// straight paths cost one leg, not one point per tile. Empty paths have no
+// start.
+class Path
+{
+public:
+    Path() : has_start(false) { }
+
+    void Clear()
+    {
+        has_start = false;
+        legs.clear();
+    }
+
+    // Appends a tile. Anything but the first has to be next to the last
+    // one; returns false and leaves the path alone if it is not.
+    bool Append(const Point& tile)
+    {
+        if (!has_start)
+        {
+            start = tile;
+            end = tile;
+            has_start = true;
+            return true;
+        }
+
+        int direction = DirectionOf(end, tile);
+        if (direction < 0)
+            return false;
+
+        AppendLeg(direction, 1);
+        return true;
+    }
+
+    // Only valid once there is a start. Runs on from the last leg if it
+    // goes the same way.
+    void AppendLeg(unsigned char direction, unsigned int tiles)
+    {
+        if (!tiles)
+            return;
+
+        if (!legs.empty() && legs.back().direction == direction)
+            legs.back().tiles += tiles;
+        else
+            legs.push_back(PathLeg(direction, tiles));
+
+        Point step = DirectionStep(direction);
+        end.x += step.x * (int)tiles;
+        end.y += step.y * (int)tiles;
+    }
+
+    // Moves the whole path; the legs are relative, so only the ends move.
+    void Shift(const Point& offset)
+    {
+        start.x += offset.x;
+        start.y += offset.y;
+        end.x += offset.x;
+        end.y += offset.y;
+    }
+
+    inline bool IsEmpty() const { return !has_start; }
+    inline Point const& GetStart() const { return start; }
+    inline Point const& GetEnd() const { return end; }
+    inline std::vector<PathLeg> const& GetLegs() const { return legs; }
+
+    // Tiles to step onto, start included.
+    unsigned long GetTileCount() const
+    {
+        if (!has_start)
+            return 0;
+
+        unsigned long ret = 1;
+        for (auto& l : legs)
+            ret += l.tiles;
+
+        return ret;
+    }
+
+    // Frees the legs if they grew past capacity, otherwise just clears.
+    void Reset(size_t capacity)
+    {
+        if (legs.capacity() > capacity)
+            std::vector<PathLeg>().swap(legs);
+
+        Clear();
+    }
+
+    inline bool operator==(const Path& o) const
+    {
+        if (has_start != o.has_start)
+            return false;
+
+        return !has_start || (start == o.start && legs == o.legs);
+    }
+    inline bool operator!=(const Path& o) const { return !(*this == o); }
+private:
+    bool has_start;
+    Point start;
+    Point end;
+    std::vector<PathLeg> legs;
+};
+
+
+// Walks a path one tile at a time without expanding it into tiles. Legs
+// are dropped as they are finished, and up to INLINE_LEGS of them are kept
+// without touching the heap, which covers most paths; a long walk built up
+// a tile at a time stays small as long as it is walked about as fast.
+class PathWalker
+{
+public:
+    enum { INLINE_LEGS = 4 };
+
+    PathWalker()
+        : has_path(false),
+          started(false),
+          tiles(0)
+    { }
+
+    void Clear()
+    {
+        legs.clear();
+        has_path = false;
+        started = false;
+        tiles = 0;
+    }
+
+    void Set(const Path& path)
+    {
+        Clear();
+
+        if (path.IsEmpty())
+            return;
+
+        has_path = true;
+        start = path.GetStart();
+        end = path.GetEnd();
+
+        for (auto& l : path.GetLegs())
+            legs.push_back(l);
+    }
+
+    // Appends a tile; see Path::Append.
+    bool Append(const Point& tile)
+    {
+        if (!has_path)
+        {
+            has_path = true;
+            start = tile;
+            end = tile;
+            return true;
+        }
+
+        int direction = DirectionOf(end, tile);
+        if (direction < 0)
+            return false;
+
+        if (!legs.empty() && legs.back().direction == direction)
+            legs.back().tiles++;
+        else
+            legs.push_back(PathLeg(direction, 1));
+
+        end = tile;
+        return true;
+    }
+
+    inline bool IsDone() const { return !has_path; }
+
+    // The last tile of the path. Not valid once done.
+    inline Point const& GetEnd() const { return end; }
+
+    // The tile the next step goes to. Not valid once done.
+    Point Next() const
+    {
+        if (!started)
+            return start;
+
+        Point step = DirectionStep(legs.front().direction);
+        return Point(at.x + step.x, at.y + step.y);
+    }
+
+    // Takes the step to Next(). Clears the path after the last one.
+    void Advance()
+    {
+        if (!started)
+        {
+            started = true;
+            at = start;
+        }
+        else
+        {
+            at = Next();
+
+            if (++tiles == legs.front().tiles)
+            {
+                legs.pop_front();
+                tiles = 0;
+            }
+        }
+
+        if (legs.empty())
+            Clear();
+    }
+
+    // Takes up to steps steps at once and returns the tile the last one
+    // went to. Costs one go round per leg finished, however many tiles
+    // that is. Not valid once done, or for no steps.
+    Point Skip(unsigned int steps)
+    {
+        if (!started)
+        {
+            started = true;
+            at = start;
+            steps--;
+        }
+
+        while (steps && !legs.empty())
+        {
+            PathLeg& leg = legs.front();
+            unsigned int n = std::min(steps, leg.tiles - tiles);
+            Point step = DirectionStep(leg.direction);
+
+            at.x += step.x * (int)n;
+            at.y += step.y * (int)n;
+            steps -= n;
+
+            if ((tiles += n) == leg.tiles)
+            {
+                legs.pop_front();
+                tiles = 0;
+            }
+        }
+
+        Point ret = at;
+
+        if (legs.empty())
+            Clear();
+
+        return ret;
+    }
+private:
+    InlineRing<PathLeg,INLINE_LEGS> legs;
+    bool has_path;
+    bool started;
+
+    // Steps taken along the first leg.
+    unsigned int tiles;
+
+    Point start;
+    Point end;
+    Point at;
+};
+
+#endif
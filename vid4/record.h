@@ -0,0 +1,430 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "comm.h"
+#include "codec.h"
+
+
+// Session log layout (all integers little-endian):
+//
+//   header   RecordHeader
+//   records  uint time since previous record (ms), u8 from, u8 to,
+//            message frame as in codec.h
+//   index    RecordIndexEntry, one per INDEX_INTERVAL records
+//
+// from has BATCH_START set on the first record of each batch the router
+// handed over in one go, so a player can replay the same batches.
+//
+// The index is written when the recorder is closed. A log without one (the
+// recorder never got to close it) is still readable; the player rebuilds the
+// index by scanning.
+struct RecordHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long index_offset;
+    unsigned long long index_count;
+    unsigned long long record_count;
+    unsigned int duration;
+    unsigned int reserved;
+};
+
+
+struct RecordIndexEntry
+{
+    unsigned int time;
+    unsigned int previous_time;
+    unsigned long long offset;
+};
+
+
+// Writes everything the router moves to a session log. Install it with
+// Router::SetTap(); it only reads the messages it is shown.
+class Recorder : public RouterTap
+{
+public:
+    enum
+    {
+        MAGIC = 0x6c726763,
+        VERSION = 2,
+        INDEX_INTERVAL = 256,
+        BATCH_START = 0x80
+    };
+
+    Recorder(const std::string& path)
+        : file(path.c_str(), std::ios::binary | std::ios::trunc),
+          start(Time::GetNow()),
+          last_time(0),
+          offset(sizeof(RecordHeader)),
+          record_count(0)
+    {
+        if (!file)
+            throw std::runtime_error("Failed to open recording: " + path);
+
+        RecordHeader header = RecordHeader();
+        header.magic = MAGIC;
+        header.version = VERSION;
+        file.write((const char*)&header, sizeof(header));
+    }
+
+    virtual ~Recorder()
+    {
+        Close();
+    }
+
+    virtual void OnRoute(int from, int to,
+                         const std::vector<Message*>& messages)
+    {
+        if (!file.is_open() || messages.empty())
+            return;
+
+        unsigned int now = Time::GetNow() - start;
+        if (now < last_time)
+            now = last_time;
+
+        scratch.clear();
+        WireWriter w(scratch);
+
+        unsigned char batch = BATCH_START;
+
+        for (auto& m : messages)
+        {
+            if (record_count % INDEX_INTERVAL == 0)
+            {
+                RecordIndexEntry entry;
+                entry.time = now;
+                entry.previous_time = last_time;
+                entry.offset = offset + scratch.size();
+                index.push_back(entry);
+            }
+
+            w.PutVarint(now - last_time);
+            w.PutByte((unsigned char)from | batch);
+            w.PutByte((unsigned char)to);
+            MessageCodec::EncodeFrame(*m, scratch);
+
+            batch = 0;
+            last_time = now;
+            record_count++;
+        }
+
+        file.write((const char*)&scratch[0], scratch.size());
+        offset += scratch.size();
+    }
+
+    // Writes the index and the final header. Nothing is recorded after.
+    void Close()
+    {
+        if (!file.is_open())
+            return;
+
+        if (!index.empty())
+            file.write((const char*)&index[0],
+                       index.size() * sizeof(RecordIndexEntry));
+
+        RecordHeader header = RecordHeader();
+        header.magic = MAGIC;
+        header.version = VERSION;
+        header.index_offset = offset;
+        header.index_count = index.size();
+        header.record_count = record_count;
+        header.duration = last_time;
+
+        file.seekp(0);
+        file.write((const char*)&header, sizeof(header));
+        file.close();
+    }
+
+    inline unsigned long long GetRecordCount() const { return record_count; }
+private:
+    std::ofstream file;
+
+    unsigned int start;
+    unsigned int last_time;
+    unsigned long long offset;
+    unsigned long long record_count;
+
+    std::vector<unsigned char> scratch;
+    std::vector<RecordIndexEntry> index;
+};
+
+
+// Plays back the server's side of a session log: every message that was
+// routed from ADDR_UPLINK is sent again through the given endpoint, which is
+// normally the one Router::Register(ADDR_UPLINK) returned. The log is mapped
+// and decoded in place.
+//
+// In real time, Update() sends everything whose recorded time has come. As
+// fast as possible, each Update() sends the next recorded batch (as marked
+// by the recorder, not by time), so the client sees the same batches it saw
+// in the session, just without the waits between them.
+class LogPlayer
+{
+public:
+    LogPlayer(Endpoint& uplink, const std::string& path,
+              bool realtime = true)
+        : uplink(uplink),
+          realtime(realtime)
+    {
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open recording: " + path);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(RecordHeader))
+        {
+            close(fd);
+            throw std::runtime_error("Not a recording: " + path);
+        }
+
+        size = st.st_size;
+
+        void* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Failed to map recording: " + path);
+        }
+
+        data = (const unsigned char*)base;
+
+        RecordHeader header;
+        memcpy(&header, data, sizeof(header));
+
+        if (header.magic != Recorder::MAGIC ||
+            header.version != Recorder::VERSION)
+        {
+            munmap(base, size);
+            close(fd);
+            throw std::runtime_error("Not a recording: " + path);
+        }
+
+        if (header.index_offset &&
+            header.index_offset + header.index_count *
+                sizeof(RecordIndexEntry) <= size)
+        {
+            end = header.index_offset;
+            duration = header.duration;
+            record_count = header.record_count;
+
+            index.resize(header.index_count);
+            if (!index.empty())
+                memcpy(&index[0], data + end,
+                       index.size() * sizeof(RecordIndexEntry));
+        }
+        else
+        {
+            Scan();
+        }
+
+        Seek(0);
+    }
+
+    virtual ~LogPlayer()
+    {
+        munmap((void*)data, size);
+        close(fd);
+    }
+
+    // Sends whatever is due and returns how many messages that was.
+    size_t Update()
+    {
+        if (IsFinished())
+            return 0;
+
+        outbox.clear();
+
+        if (realtime)
+        {
+            unsigned int due = Time::GetNow() - origin;
+
+            while (!IsFinished() && PeekTime() <= due)
+                Replay();
+        }
+        else
+        {
+            // Batches that held nothing to replay (the client's own
+            // traffic, say) are passed over rather than cost a frame.
+            while (!IsFinished() && outbox.empty())
+            {
+                do
+                    Replay();
+                while (!IsFinished() && !PeekBatchStart());
+            }
+        }
+
+        uplink.SendAll(outbox);
+        return outbox.size();
+    }
+
+    // Moves playback to the first record at or after time (ms into the
+    // session). Records skipped over are not sent, so seeking anywhere but
+    // the start only makes sense for a client that can cope with entities
+    // it never saw appear.
+    void Seek(unsigned int time)
+    {
+        position = sizeof(RecordHeader);
+        clock = 0;
+
+        // Start from the last indexed record before time; records at time
+        // itself may come before the next one.
+        auto it = std::lower_bound(
+            index.begin(), index.end(), time,
+            [](const RecordIndexEntry& e, unsigned int t)
+            {
+                return e.time < t;
+            });
+
+        if (it != index.begin())
+        {
+            --it;
+            position = it->offset;
+            clock = it->previous_time;
+        }
+
+        while (!IsFinished() && PeekTime() < time)
+            Skip();
+
+        origin = Time::GetNow() - time;
+    }
+
+    inline bool IsFinished() const { return position >= end; }
+    inline unsigned int GetDuration() const { return duration; }
+    inline unsigned long long GetRecordCount() const { return record_count; }
+private:
+    // Recorded time of the record at position.
+    unsigned int PeekTime()
+    {
+        WireReader r(data + position, end - position);
+        return clock + r.GetVarint();
+    }
+
+    // Whether the record at position starts a routed batch.
+    bool PeekBatchStart()
+    {
+        WireReader r(data + position, end - position);
+        r.GetVarint();
+        return r.GetByte() & Recorder::BATCH_START;
+    }
+
+    // Takes the record at position into outbox if it is to be replayed.
+    void Replay()
+    {
+        int from, to;
+        Message* m = Next(from, to);
+
+        // Copies that went to subscribers are in the log too; only the one
+        // sent to the message's own destination is replayed.
+        if (from == ADDR_UPLINK && to == m->GetDestination())
+            outbox.push_back(m);
+        else
+            m->Release();
+    }
+
+    Message* Next(int& from, int& to)
+    {
+        WireReader r(data + position, end - position);
+
+        clock += r.GetVarint();
+        from = r.GetByte() & ~Recorder::BATCH_START;
+        to = r.GetByte();
+
+        size_t header = r.GetConsumed();
+        size_t consumed;
+
+        Message* ret = MessageCodec::DecodeFrame(
+            data + position + header, end - position - header, consumed);
+
+        if (!ret)
+            throw std::runtime_error("Truncated recording.");
+
+        position += header + consumed;
+        return ret;
+    }
+
+    void Skip()
+    {
+        int from, to;
+        Next(from, to)->Release();
+    }
+
+    // Rebuilds the index of a log whose recorder never closed it. A record
+    // cut short at the end is dropped.
+    void Scan()
+    {
+        end = size;
+        duration = 0;
+        record_count = 0;
+        index.clear();
+
+        unsigned long long offset = sizeof(RecordHeader);
+        unsigned int time = 0;
+
+        while (offset < size)
+        {
+            try
+            {
+                WireReader r(data + offset, size - offset);
+
+                unsigned int record_time = time + r.GetVarint();
+                r.Skip(2);
+
+                unsigned int length = r.GetVarint();
+                r.Skip(length);
+
+                if (record_count % Recorder::INDEX_INTERVAL == 0)
+                {
+                    RecordIndexEntry entry;
+                    entry.time = record_time;
+                    entry.previous_time = time;
+                    entry.offset = offset;
+                    index.push_back(entry);
+                }
+
+                time = record_time;
+                offset += r.GetConsumed();
+                record_count++;
+            }
+            catch (std::runtime_error&)
+            {
+                break;
+            }
+        }
+
+        end = offset;
+        duration = time;
+    }
+
+    Endpoint& uplink;
+    bool realtime;
+
+    int fd;
+    size_t size;
+    const unsigned char* data;
+    unsigned long long end;
+
+    unsigned int duration;
+    unsigned long long record_count;
+    std::vector<RecordIndexEntry> index;
+
+    unsigned long long position;
+    unsigned int clock;
+    unsigned int origin;
+
+    std::vector<Message*> outbox;
+};
+
+#endif
@@ -0,0 +1,701 @@
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "common.h"
+#include "comm.h"
+#include "snapshot.h"
+
+
+// A scenario is a set of scripts and the agents that run them. The text
+// form is line-based; '#' starts a comment:
+//
+//   script <name>
+//       identity <name> <skin> <map> <x,y>
+//       appear <name> <skin> <x,y>
+//       wait <ms>
+//       move <speed> <x,y> <x,y> ...
+//       act <action-id> <x,y> [<target> <hp>] ...
+//       disappear
+//       loop
+//       repeat
+//   end
+//   spawn <script> <count> [stagger-ms] [spacing]
+//
+// Each agent spawned gets the next entity id, starting at 0. A target is an
+// entity id, "self", or "any" for a random agent currently in the world.
+// Each tile of a move has to be next to the one before it. Agents from one
+// spawn line start stagger-ms apart and have all their coordinates shifted
+// onto a grid spacing tiles apart, so a crowd does not stand on one tile.
+// repeat goes back to the last loop line, or to the top of the script if
+// there is none; what it repeats must include a wait.
+struct ScenarioTarget
+{
+    enum { SELF = -1, ANY = -2 };
+
+    int entity_id;
+    int hp;
+};
+
+
+struct ScenarioStep
+{
+    enum Op { IDENTITY, APPEAR, WAIT, MOVE, ACT, DISAPPEAR, LOOP, REPEAT };
+
+    Op op;
+    unsigned int value = 0;
+    std::string name;
+    std::string skin;
+    std::string map;
+    Point loc;
+    Path path;
+    std::vector<ScenarioTarget> targets;
+};
+
+
+struct ScenarioScript
+{
+    std::vector<ScenarioStep> steps;
+};
+
+
+// Runs a scenario against an uplink endpoint, standing in for the server.
+//
+// Every agent is a stackless coroutine over its script: it runs until its
+// next wait, then goes back on a timer heap keyed by the time it should
+// resume. Update() resumes whatever is due and sends everything the agents
+// produced in one batch, so the cost per tick is proportional to the agents
+// that actually act, not to the size of the crowd.
+//
+// With snapshots on, appearing and moving only change the agent's state,
+// which a SnapshotServer publishes as deltas once per tick; identity,
+// actions and disappearing are still sent as they happen. Acks from the
+// client are read back off the uplink.
+class ScenarioRuntime
+{
+public:
+    // Agents start at full health and walking pace, as characters do on
+    // the client.
+    enum { AGENT_HP = 100, AGENT_SPEED = 125 };
+
+    ScenarioRuntime(Endpoint& uplink, bool snapshots = false)
+        : uplink(uplink),
+          snapshots(snapshots ? new SnapshotServer(uplink) : NULL),
+          next_id(0),
+          random_state(1),
+          sent(0)
+    { }
+
+    virtual ~ScenarioRuntime()
+    {
+        delete snapshots;
+    }
+
+    void LoadFile(const std::string& path)
+    {
+        std::ifstream file(path.c_str());
+        if (!file)
+            throw std::runtime_error("Failed to open scenario: " + path);
+
+        Load(file);
+    }
+
+    void LoadString(const std::string& text)
+    {
+        std::istringstream stream(text);
+        Load(stream);
+    }
+
+    // Parses a scenario and schedules its agents, the first of them right
+    // away. Can be called more than once to add to a running scenario.
+    void Load(std::istream& in)
+    {
+        std::string line;
+        unsigned int line_number = 0;
+        ScenarioScript* script = NULL;
+        unsigned int start = Time::GetNow();
+
+        while (std::getline(in, line))
+        {
+            line_number++;
+
+            size_t comment = line.find('#');
+            if (comment != std::string::npos)
+                line.erase(comment);
+
+            std::istringstream tokens(line);
+            std::string keyword;
+
+            if (!(tokens >> keyword))
+                continue;
+
+            try
+            {
+                if (keyword == "script")
+                {
+                    if (script)
+                        throw std::runtime_error("Missing end.");
+
+                    std::string name = ReadWord(tokens);
+
+                    if (scripts.count(name))
+                        throw std::runtime_error("Duplicate script.");
+
+                    script = &scripts[name];
+                }
+                else if (keyword == "end")
+                {
+                    if (!script)
+                        throw std::runtime_error("end outside a script.");
+
+                    Validate(*script);
+                    script = NULL;
+                }
+                else if (keyword == "spawn")
+                {
+                    if (script)
+                        throw std::runtime_error("spawn inside a script.");
+
+                    Spawn(tokens, start);
+                }
+                else if (script)
+                {
+                    AddStep(*script, ParseStep(keyword, tokens));
+                }
+                else
+                {
+                    throw std::runtime_error("Unknown keyword: " + keyword);
+                }
+            }
+            catch (std::runtime_error& e)
+            {
+                throw std::runtime_error("Scenario line " +
+                    std::to_string(line_number) + ": " + e.what());
+            }
+        }
+
+        if (script)
+            throw std::runtime_error("Scenario ends inside a script.");
+    }
+
+    // Resumes every agent that is due and sends what they produced.
+    void Update()
+    {
+        inbox.clear();
+        uplink.PollAll(inbox);
+
+        for (auto& msg : inbox)
+        {
+            if (snapshots && msg->GetType() == MSG_SNAPSHOT_ACK)
+                snapshots->Acknowledge(
+                    static_cast<SnapshotAckMessage*>(msg)->sequence);
+
+            msg->Release();
+        }
+
+        unsigned int now = Time::GetNow();
+
+        while (!wakeups.empty() && (int)(now - wakeups.top().time) >= 0)
+        {
+            Wakeup w = wakeups.top();
+            wakeups.pop();
+
+            Resume(w.agent, w.time);
+        }
+
+        if (!outbox.empty())
+        {
+            sent += outbox.size();
+            uplink.SendAll(outbox);
+            outbox.clear();
+        }
+
+        if (snapshots)
+            snapshots->Publish();
+    }
+
+    inline size_t GetAgentCount() const { return agents.size(); }
+    inline size_t GetLiveCount() const { return live.size(); }
+    inline unsigned long GetMessagesSent() const { return sent; }
+
+    // NULL unless snapshots are on.
+    inline SnapshotServer const* GetSnapshots() const { return snapshots; }
+private:
+    struct Agent
+    {
+        const ScenarioScript* script;
+        unsigned int entity_id;
+        Point offset;
+        size_t pc;
+
+        // Position in live, or -1 while not in the world.
+        int live_index;
+
+        // What snapshots replicate.
+        EntityState state;
+    };
+
+    struct Wakeup
+    {
+        unsigned int time;
+        unsigned int agent;
+
+        inline bool operator>(const Wakeup& o) const
+        {
+            return (int)(time - o.time) > 0;
+        }
+    };
+
+    // Runs an agent from where it left off to its next wait. Waits are
+    // counted from when the agent was due rather than when it actually ran,
+    // so a late tick does not push the rest of its script back.
+    void Resume(unsigned int index, unsigned int time)
+    {
+        Agent& a = agents[index];
+        const std::vector<ScenarioStep>& steps = a.script->steps;
+
+        while (a.pc < steps.size())
+        {
+            const ScenarioStep& step = steps[a.pc++];
+
+            switch (step.op)
+            {
+            case ScenarioStep::IDENTITY:
+            {
+                IdentityMessage* m = MessagePool<IdentityMessage>::Acquire();
+                FillAppear(a, step, *m);
+                m->map = step.map;
+                outbox.push_back(m);
+                Enter(index);
+                Track(a, step);
+                break;
+            }
+            case ScenarioStep::APPEAR:
+            {
+                if (snapshots)
+                {
+                    Enter(index);
+                    Track(a, step);
+                    break;
+                }
+
+                EntityAppearMessage* m =
+                    MessagePool<EntityAppearMessage>::Acquire();
+                FillAppear(a, step, *m);
+                outbox.push_back(m);
+                Enter(index);
+                break;
+            }
+            case ScenarioStep::WAIT:
+            {
+                Wakeup w;
+                w.time = time + step.value;
+                w.agent = index;
+                wakeups.push(w);
+                return;
+            }
+            case ScenarioStep::MOVE:
+            {
+                if (snapshots)
+                {
+                    a.state.speed = step.value;
+                    a.state.path = step.path;
+                    a.state.path.Shift(a.offset);
+
+                    if (!a.state.path.IsEmpty())
+                        a.state.loc = a.state.path.GetStart();
+
+                    snapshots->Track(a.entity_id, a.state);
+                    break;
+                }
+
+                EntityMoveMessage* m =
+                    MessagePool<EntityMoveMessage>::Acquire();
+                m->entity_id = a.entity_id;
+                m->speed = step.value;
+
+                m->path = step.path;
+                m->path.Shift(a.offset);
+
+                outbox.push_back(m);
+                break;
+            }
+            case ScenarioStep::ACT:
+            {
+                EntityActionMessage* m =
+                    MessagePool<EntityActionMessage>::Acquire();
+                m->entity_id = a.entity_id;
+                m->action_id = step.value;
+                m->action_loc = Shift(step.loc, a.offset);
+
+                for (auto& t : step.targets)
+                {
+                    ActionAffectedDetails detail;
+                    detail.hp = t.hp;
+
+                    if (t.entity_id == ScenarioTarget::SELF)
+                        detail.entity_id = a.entity_id;
+                    else if (t.entity_id != ScenarioTarget::ANY)
+                        detail.entity_id = t.entity_id;
+                    else if (!live.empty())
+                        detail.entity_id =
+                            agents[live[Random() % live.size()]].entity_id;
+                    else
+                        continue;
+
+                    m->affected.push_back(detail);
+                }
+
+                if (snapshots)
+                {
+                    for (auto& d : m->affected)
+                        if (Agent* target = FindLive(d.entity_id))
+                        {
+                            target->state.hp = d.hp;
+                            snapshots->Track(target->entity_id,
+                                             target->state);
+                        }
+                }
+
+                outbox.push_back(m);
+                break;
+            }
+            case ScenarioStep::DISAPPEAR:
+            {
+                EntityDisappearMessage* m =
+                    MessagePool<EntityDisappearMessage>::Acquire();
+                m->entity_id = a.entity_id;
+                outbox.push_back(m);
+                Leave(index);
+
+                if (snapshots)
+                    snapshots->Forget(a.entity_id);
+                break;
+            }
+            case ScenarioStep::LOOP:
+                break;
+            case ScenarioStep::REPEAT:
+                a.pc = step.value;
+                break;
+            }
+        }
+    }
+
+    void FillAppear(const Agent& a, const ScenarioStep& step,
+                    EntityAppearMessage& m)
+    {
+        m.entity_id = a.entity_id;
+        m.name = step.name;
+        m.skin = step.skin;
+        m.loc = Shift(step.loc, a.offset);
+    }
+
+    // Starts replicating an agent that has just come into the world.
+    void Track(Agent& a, const ScenarioStep& step)
+    {
+        if (!snapshots)
+            return;
+
+        a.state = EntityState();
+        a.state.name = step.name;
+        a.state.skin = step.skin;
+        a.state.loc = Shift(step.loc, a.offset);
+        a.state.hp = AGENT_HP;
+        a.state.speed = AGENT_SPEED;
+
+        snapshots->Track(a.entity_id, a.state);
+    }
+
+    // NULL unless entity_id is an agent in the world. Agents are numbered
+    // in the order they were spawned.
+    inline Agent* FindLive(unsigned int entity_id)
+    {
+        if (entity_id >= agents.size() || agents[entity_id].live_index < 0)
+            return NULL;
+
+        return &agents[entity_id];
+    }
+
+    void Enter(unsigned int index)
+    {
+        Agent& a = agents[index];
+
+        if (a.live_index >= 0)
+            return;
+
+        a.live_index = live.size();
+        live.push_back(index);
+    }
+
+    void Leave(unsigned int index)
+    {
+        Agent& a = agents[index];
+
+        if (a.live_index < 0)
+            return;
+
+        unsigned int moved = live.back();
+        live[a.live_index] = moved;
+        agents[moved].live_index = a.live_index;
+        live.pop_back();
+
+        a.live_index = -1;
+    }
+
+    static inline Point Shift(const Point& p, const Point& offset)
+    {
+        return Point(p.x + offset.x, p.y + offset.y);
+    }
+
+    // Fixed-seed generator so that a scenario always plays out the same.
+    inline unsigned int Random()
+    {
+        random_state = random_state * 1103515245 + 12345;
+        return random_state >> 8;
+    }
+
+    void Spawn(std::istringstream& tokens, unsigned int start)
+    {
+        std::string name = ReadWord(tokens);
+
+        auto it = scripts.find(name);
+        if (it == scripts.end())
+            throw std::runtime_error("Unknown script: " + name);
+
+        unsigned int count = ReadNumber(tokens);
+        unsigned int stagger = 0;
+        unsigned int spacing = 0;
+
+        if (tokens >> std::ws && !tokens.eof())
+            stagger = ReadNumber(tokens);
+        if (tokens >> std::ws && !tokens.eof())
+            spacing = ReadNumber(tokens);
+
+        // Square-ish grid for the crowd.
+        unsigned int columns = 1;
+        while (columns * columns < count)
+            columns++;
+
+        for (unsigned int i = 0; i < count; i++)
+        {
+            Agent a;
+            a.script = &it->second;
+            a.entity_id = next_id++;
+            a.offset = Point((i % columns) * spacing,
+                             (i / columns) * spacing);
+            a.pc = 0;
+            a.live_index = -1;
+
+            Wakeup w;
+            w.time = start + i * stagger;
+            w.agent = agents.size();
+
+            agents.push_back(a);
+            wakeups.push(w);
+        }
+    }
+
+    static ScenarioStep ParseStep(const std::string& keyword,
+                                  std::istringstream& tokens)
+    {
+        ScenarioStep step;
+
+        if (keyword == "identity")
+        {
+            step.op = ScenarioStep::IDENTITY;
+            step.name = ReadWord(tokens);
+            step.skin = ReadWord(tokens);
+            step.map = ReadWord(tokens);
+            step.loc = ReadPoint(tokens);
+        }
+        else if (keyword == "appear")
+        {
+            step.op = ScenarioStep::APPEAR;
+            step.name = ReadWord(tokens);
+            step.skin = ReadWord(tokens);
+            step.loc = ReadPoint(tokens);
+        }
+        else if (keyword == "wait")
+        {
+            step.op = ScenarioStep::WAIT;
+            step.value = ReadNumber(tokens);
+        }
+        else if (keyword == "move")
+        {
+            step.op = ScenarioStep::MOVE;
+            step.value = ReadNumber(tokens);
+
+            while (tokens >> std::ws && !tokens.eof())
+                if (!step.path.Append(ReadPoint(tokens)))
+                    throw std::runtime_error(
+                        "Path tiles must be next to each other.");
+        }
+        else if (keyword == "act")
+        {
+            step.op = ScenarioStep::ACT;
+            step.value = ReadNumber(tokens);
+            step.loc = ReadPoint(tokens);
+
+            while (tokens >> std::ws && !tokens.eof())
+            {
+                ScenarioTarget target;
+                std::string who = ReadWord(tokens);
+
+                if (who == "self")
+                    target.entity_id = ScenarioTarget::SELF;
+                else if (who == "any")
+                    target.entity_id = ScenarioTarget::ANY;
+                else
+                    target.entity_id = ParseNumber(who);
+
+                target.hp = ReadNumber(tokens);
+                step.targets.push_back(target);
+            }
+        }
+        else if (keyword == "disappear")
+        {
+            step.op = ScenarioStep::DISAPPEAR;
+        }
+        else if (keyword == "loop")
+        {
+            step.op = ScenarioStep::LOOP;
+        }
+        else if (keyword == "repeat")
+        {
+            step.op = ScenarioStep::REPEAT;
+        }
+        else
+        {
+            throw std::runtime_error("Unknown step: " + keyword);
+        }
+
+        std::string extra;
+        if (tokens >> extra)
+            throw std::runtime_error("Unexpected: " + extra);
+
+        return step;
+    }
+
+    // Points a repeat at the loop line it goes back to.
+    static void AddStep(ScenarioScript& script, const ScenarioStep& step)
+    {
+        script.steps.push_back(step);
+
+        if (step.op != ScenarioStep::REPEAT)
+            return;
+
+        size_t target = 0;
+
+        for (size_t i = script.steps.size() - 1; i > 0; i--)
+            if (script.steps[i - 1].op == ScenarioStep::LOOP)
+            {
+                target = i - 1;
+                break;
+            }
+
+        script.steps.back().value = target;
+    }
+
+    // A script that repeats without waiting would never give control back.
+    static void Validate(const ScenarioScript& script)
+    {
+        for (size_t i = 0; i < script.steps.size(); i++)
+        {
+            const ScenarioStep& step = script.steps[i];
+
+            if (step.op != ScenarioStep::REPEAT)
+                continue;
+
+            unsigned int waited = 0;
+
+            for (size_t j = step.value; j < i; j++)
+                if (script.steps[j].op == ScenarioStep::WAIT)
+                    waited += script.steps[j].value;
+
+            if (!waited)
+                throw std::runtime_error("Script repeats without waiting.");
+        }
+    }
+
+    static std::string ReadWord(std::istringstream& tokens)
+    {
+        std::string ret;
+        if (!(tokens >> ret))
+            throw std::runtime_error("Missing argument.");
+        return ret;
+    }
+
+    static unsigned int ParseNumber(const std::string& word)
+    {
+        size_t used = 0;
+        unsigned long ret = 0;
+
+        try
+        {
+            ret = std::stoul(word, &used);
+        }
+        catch (std::exception&)
+        {
+        }
+
+        if (!used || used != word.size())
+            throw std::runtime_error("Not a number: " + word);
+
+        return ret;
+    }
+
+    static inline unsigned int ReadNumber(std::istringstream& tokens)
+    {
+        return ParseNumber(ReadWord(tokens));
+    }
+
+    static Point ReadPoint(std::istringstream& tokens)
+    {
+        std::string word = ReadWord(tokens);
+        size_t comma = word.find(',');
+
+        if (comma == std::string::npos)
+            throw std::runtime_error("Not a point: " + word);
+
+        try
+        {
+            size_t used_x, used_y;
+            int x = std::stoi(word.substr(0, comma), &used_x);
+            int y = std::stoi(word.substr(comma + 1), &used_y);
+
+            if (used_x == comma && used_y == word.size() - comma - 1)
+                return Point(x, y);
+        }
+        catch (std::exception&)
+        {
+        }
+
+        throw std::runtime_error("Not a point: " + word);
+    }
+
+    Endpoint& uplink;
+    SnapshotServer* snapshots;
+
+    std::map<std::string,ScenarioScript> scripts;
+    std::vector<Agent> agents;
+    std::vector<unsigned int> live;
+
+    std::priority_queue<Wakeup,std::vector<Wakeup>,std::greater<Wakeup> >
+        wakeups;
+
+    unsigned int next_id;
+    unsigned int random_state;
+
+    std::vector<Message*> inbox;
+    std::vector<Message*> outbox;
+    unsigned long sent;
+};
+
+#endif
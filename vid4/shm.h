@@ -0,0 +1,407 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+
+#include "comm.h"
+#include "codec.h"
+
+
+// Shared by both processes. Each direction is a byte ring written by one
+// process and read by the other; head/tail only ever grow and are reduced
+// modulo the ring size when used.
+struct ShmRingControl
+{
+    std::atomic<unsigned long long> head;
+    char pad0[CACHE_LINE_SIZE - sizeof(std::atomic<unsigned long long>)];
+
+    std::atomic<unsigned long long> tail;
+    char pad1[CACHE_LINE_SIZE - sizeof(std::atomic<unsigned long long>)];
+
+    // Futex word bumped by the producer, only when the consumer has said
+    // it is going to sleep.
+    std::atomic<unsigned int> waiting;
+    std::atomic<unsigned int> signal;
+    char pad2[CACHE_LINE_SIZE - 2 * sizeof(std::atomic<unsigned int>)];
+};
+
+
+struct ShmSegmentHeader
+{
+    unsigned int magic;
+    unsigned int ring_size;
+    char pad[CACHE_LINE_SIZE - 2 * sizeof(unsigned int)];
+
+    ShmRingControl rings[2];
+};
+
+
+// Router-compatible transport between two processes on the same host. One
+// process creates the named segment and the other attaches to it; after
+// that the two sides are symmetric. Messages cross in the binary format from
+// codec.h and are decoded in place out of the shared ring, so the hot path
+// makes no system calls at all. The futex is only touched when a reader has
+// run out of work and gone to sleep in WaitForInput().
+//
+// Nothing here starts a thread: the owner calls Update() to move messages
+// in both directions, from the thread that consumes the endpoint.
+//
+// A record that does not fit in what was written, or does not decode, means
+// the other process cannot be trusted to be writing this format any more:
+// the transport stops reading and writing and IsConnected() turns false.
+class ShmTransport
+{
+public:
+    static const unsigned int MAGIC = 0x63677368;
+    static const unsigned int DEFAULT_RING_SIZE = 1 << 20;
+
+    ShmTransport(Endpoint& endpoint,
+                 const std::string& name,
+                 bool create,
+                 unsigned int ring_size = DEFAULT_RING_SIZE)
+        : endpoint(endpoint),
+          name(name),
+          creator(create),
+          connected(true),
+          malformed(0)
+    {
+        static_assert(sizeof(std::atomic<unsigned long long>) ==
+                      sizeof(unsigned long long),
+                      "Shared ring indices must be lock-free.");
+
+        int flags = create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR;
+
+        if (create)
+            shm_unlink(name.c_str());
+
+        fd = shm_open(name.c_str(), flags, 0600);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open shared memory segment.");
+
+        if (create)
+        {
+            ring_size = (ring_size + 3) & ~3u;
+            size = sizeof(ShmSegmentHeader) + 2 * (size_t)ring_size;
+
+            if (ftruncate(fd, size) != 0)
+                throw std::runtime_error("Failed to size shared memory.");
+        }
+        else
+        {
+            struct stat st;
+            if (fstat(fd, &st) != 0)
+                throw std::runtime_error("Failed to stat shared memory.");
+
+            size = st.st_size;
+
+            // The creator may not have sized it yet.
+            if (size < sizeof(ShmSegmentHeader))
+            {
+                close(fd);
+                throw std::runtime_error("Shared memory segment not ready.");
+            }
+        }
+
+        void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fd, 0);
+        if (base == MAP_FAILED)
+            throw std::runtime_error("Failed to map shared memory.");
+
+        header = (ShmSegmentHeader*)base;
+
+        if (create)
+        {
+            // ftruncate zero-fills, which is a valid initial state for the
+            // ring controls; publish the magic last.
+            header->ring_size = ring_size;
+            std::atomic_thread_fence(std::memory_order_release);
+            header->magic = MAGIC;
+        }
+        else
+        {
+            bool ready = header->magic == MAGIC;
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            size_t rings = 2 * (size_t)header->ring_size;
+
+            if (!ready || header->ring_size == 0 ||
+                header->ring_size % 4 != 0 ||
+                size < sizeof(ShmSegmentHeader) + rings)
+            {
+                munmap(base, size);
+                close(fd);
+                throw std::runtime_error("Shared memory segment not ready.");
+            }
+        }
+
+        unsigned char* data = (unsigned char*)(header + 1);
+        int out_ring = create ? 0 : 1;
+
+        out.control = &header->rings[out_ring];
+        out.data = data + out_ring * header->ring_size;
+        in.control = &header->rings[1 - out_ring];
+        in.data = data + (1 - out_ring) * header->ring_size;
+    }
+
+    virtual ~ShmTransport()
+    {
+        munmap(header, size);
+        close(fd);
+
+        if (creator)
+            shm_unlink(name.c_str());
+    }
+
+    // Sends whatever the endpoint has queued and delivers whatever the other
+    // process has written. Returns the number of messages delivered.
+    size_t Update()
+    {
+        if (!connected)
+        {
+            Discard();
+            return 0;
+        }
+
+        Flush();
+        return Receive();
+    }
+
+    // Sleeps until the other process writes something or timeout_ms passes.
+    // Returns at once if there is already something to read.
+    void WaitForInput(unsigned int timeout_ms)
+    {
+        ShmRingControl& c = *in.control;
+
+        unsigned int seen = c.signal.load();
+        c.waiting.store(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (c.head.load(std::memory_order_relaxed) == c.tail.load())
+        {
+            struct timespec timeout;
+            timeout.tv_sec = timeout_ms / 1000;
+            timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+            syscall(SYS_futex, &c.signal, FUTEX_WAIT, seen, &timeout,
+                    NULL, 0);
+        }
+
+        c.waiting.store(0);
+    }
+
+    inline unsigned long GetBacklog() const { return backlog.size(); }
+    inline unsigned long GetMalformed() const { return malformed; }
+    inline bool IsConnected() const { return connected; }
+private:
+    // Records are a u32 length followed by an encoded message, padded to
+    // four bytes. A record never wraps; WRAP marks the unused tail end.
+    static const unsigned int WRAP = 0xffffffff;
+
+    struct Ring
+    {
+        ShmRingControl* control;
+        unsigned char* data;
+    };
+
+    static inline size_t Align(size_t n) { return (n + 3) & ~(size_t)3; }
+
+    // With nobody to send to, whatever the endpoint queues is released.
+    void Discard()
+    {
+        outbox.clear();
+        endpoint.PollAll(outbox);
+
+        for (auto& m : outbox)
+            m->Release();
+        outbox.clear();
+    }
+
+    void Flush()
+    {
+        outbox.clear();
+        endpoint.PollAll(outbox);
+
+        bool wrote = false;
+
+        while (!backlog.empty() && Write(backlog.front()))
+        {
+            backlog.pop_front();
+            wrote = true;
+        }
+
+        // Only a full ring costs an allocation: the message waits in the
+        // backlog until the other side makes room.
+        for (auto& m : outbox)
+        {
+            scratch.clear();
+            MessageCodec::Encode(*m, scratch);
+            m->Release();
+
+            if (backlog.empty() && Write(scratch))
+                wrote = true;
+            else
+                backlog.push_back(scratch);
+        }
+        outbox.clear();
+
+        if (!wrote)
+            return;
+
+        ShmRingControl& c = *out.control;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (c.waiting.load())
+        {
+            c.signal.fetch_add(1);
+            syscall(SYS_futex, &c.signal, FUTEX_WAKE, 1, NULL, NULL, 0);
+        }
+    }
+
+    bool Write(const std::vector<unsigned char>& bytes)
+    {
+        ShmRingControl& c = *out.control;
+        const size_t ring_size = header->ring_size;
+        const size_t need = Align(4 + bytes.size());
+
+        if (need > ring_size / 2)
+            throw std::runtime_error("Message too large for shared ring.");
+
+        unsigned long long tail = c.tail.load(std::memory_order_relaxed);
+        unsigned long long head = c.head.load(std::memory_order_acquire);
+
+        size_t offset = tail % ring_size;
+        size_t contiguous = ring_size - offset;
+        size_t total = contiguous < need ? contiguous + need : need;
+
+        if (ring_size - (tail - head) < total)
+            return false;
+
+        if (contiguous < need)
+        {
+            unsigned int wrap = WRAP;
+            memcpy(out.data + offset, &wrap, 4);
+            tail += contiguous;
+            offset = 0;
+        }
+
+        unsigned int length = bytes.size();
+        memcpy(out.data + offset, &length, 4);
+        memcpy(out.data + offset + 4, &bytes[0], bytes.size());
+
+        c.tail.store(tail + need, std::memory_order_release);
+        return true;
+    }
+
+    size_t Receive()
+    {
+        ShmRingControl& c = *in.control;
+        const size_t ring_size = header->ring_size;
+
+        unsigned long long head = c.head.load(std::memory_order_relaxed);
+        const unsigned long long tail =
+            c.tail.load(std::memory_order_acquire);
+
+        if (head == tail)
+            return 0;
+
+        inbox.clear();
+
+        try
+        {
+            if (tail - head > ring_size)
+                throw std::runtime_error("Ring indices out of range.");
+
+            while (head != tail)
+            {
+                size_t offset = head % ring_size;
+                size_t contiguous = ring_size - offset;
+
+                // Records never wrap, so one has to fit both in what was
+                // written and before the end of the ring.
+                size_t readable = std::min((size_t)(tail - head), contiguous);
+
+                if (readable < 4)
+                    throw std::runtime_error("Truncated record length.");
+
+                unsigned int length;
+                memcpy(&length, in.data + offset, 4);
+
+                if (length == WRAP)
+                {
+                    if (tail - head < contiguous)
+                        throw std::runtime_error("Truncated wrap marker.");
+
+                    head += contiguous;
+                    continue;
+                }
+
+                if (length > readable - 4)
+                    throw std::runtime_error("Record overruns the ring.");
+
+                size_t used;
+                inbox.push_back(MessageCodec::Decode(in.data + offset + 4,
+                                                     length, used));
+
+                if (used != length)
+                    throw std::runtime_error("Record has trailing bytes.");
+
+                head += Align(4 + length);
+            }
+        }
+        catch (std::runtime_error& e)
+        {
+            std::cout << "Malformed shared memory record: " << e.what() <<
+                std::endl;
+            malformed++;
+            connected = false;
+
+            for (auto& m : inbox)
+                m->Release();
+            inbox.clear();
+
+            return 0;
+        }
+
+        // The writer can reuse the space only once everything in it has
+        // been decoded.
+        c.head.store(head, std::memory_order_release);
+
+        endpoint.SendAll(inbox);
+        return inbox.size();
+    }
+
+    Endpoint& endpoint;
+    std::string name;
+    bool creator;
+    bool connected;
+    unsigned long malformed;
+
+    int fd;
+    size_t size;
+    ShmSegmentHeader* header;
+
+    Ring out;
+    Ring in;
+
+    std::vector<unsigned char> scratch;
+    std::deque<std::vector<unsigned char> > backlog;
+    std::vector<Message*> inbox;
+    std::vector<Message*> outbox;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef SLOTMAP_H
+#define SLOTMAP_H
+
+#include <vector>
+
+
+// Names an element of a SlotMap. A slot's generation changes every time
+// it is freed, so a handle to something that has been erased stays
+// invalid instead of quietly naming whatever took its place.
+struct SlotHandle
+{
+    SlotHandle(unsigned int index = 0, unsigned int generation = 0)
+        : index(index), generation(generation) { }
+
+    // Never names anything.
+    inline bool IsNull() const { return generation == 0; }
+
+    inline bool operator==(const SlotHandle& o) const
+    {
+        return index == o.index && generation == o.generation;
+    }
+    inline bool operator!=(const SlotHandle& o) const { return !(*this == o); }
+
+    unsigned int index;
+    unsigned int generation;
+};
+
+
+// Values in one dense vector, reached through stable handles. Insert,
+// Erase and Get are O(1): erasing moves the last value into the gap and
+// repoints its slot, and freed slots are reused through a free list.
+// Iteration runs over the dense values, in no particular order.
+template <typename T>
+class SlotMap
+{
+public:
+    typedef typename std::vector<T>::iterator iterator;
+    typedef typename std::vector<T>::const_iterator const_iterator;
+
+    SlotMap()
+        : free_head(NONE)
+    { }
+
+    SlotHandle Insert(const T& value)
+    {
+        unsigned int index;
+
+        if (free_head != NONE)
+        {
+            index = free_head;
+            free_head = slots[index].position;
+        }
+        else
+        {
+            index = slots.size();
+
+            Slot s;
+            s.generation = 1;
+            slots.push_back(s);
+        }
+
+        slots[index].position = values.size();
+        values.push_back(value);
+        owners.push_back(index);
+
+        return SlotHandle(index, slots[index].generation);
+    }
+
+    // False if handle was not valid.
+    bool Erase(SlotHandle handle)
+    {
+        if (!Contains(handle))
+            return false;
+
+        Slot& s = slots[handle.index];
+        unsigned int last = values.size() - 1;
+
+        if (s.position != last)
+        {
+            values[s.position] = values[last];
+            owners[s.position] = owners[last];
+            slots[owners[last]].position = s.position;
+        }
+
+        values.pop_back();
+        owners.pop_back();
+
+        if (++s.generation == 0)
+            s.generation = 1;
+
+        s.position = free_head;
+        free_head = handle.index;
+        return true;
+    }
+
+    inline bool Contains(SlotHandle handle) const
+    {
+        return handle.index < slots.size() &&
+               slots[handle.index].generation == handle.generation &&
+               !handle.IsNull() &&
+               IsLive(handle.index);
+    }
+
+    // NULL if handle is not valid.
+    inline T* Get(SlotHandle handle)
+    {
+        return Contains(handle) ? &values[slots[handle.index].position] : NULL;
+    }
+
+    inline const T* Get(SlotHandle handle) const
+    {
+        return Contains(handle) ? &values[slots[handle.index].position] : NULL;
+    }
+
+    // Handle of the value at a position in iteration order.
+    inline SlotHandle GetHandleAt(size_t position) const
+    {
+        unsigned int index = owners[position];
+        return SlotHandle(index, slots[index].generation);
+    }
+
+    inline size_t Size() const { return values.size(); }
+    inline bool Empty() const { return values.empty(); }
+
+    inline iterator begin() { return values.begin(); }
+    inline iterator end() { return values.end(); }
+    inline const_iterator begin() const { return values.begin(); }
+    inline const_iterator end() const { return values.end(); }
+private:
+    enum { NONE = 0xffffffff };
+
+    // A live slot holds its value's position; a free one, the next free
+    // slot.
+    struct Slot
+    {
+        unsigned int position;
+        unsigned int generation;
+    };
+
+    inline bool IsLive(unsigned int index) const
+    {
+        unsigned int position = slots[index].position;
+        return position < owners.size() && owners[position] == index;
+    }
+
+    std::vector<T> values;
+    std::vector<unsigned int> owners;
+    std::vector<Slot> slots;
+    unsigned int free_head;
+};
+
+#endif
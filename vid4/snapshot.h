@@ -0,0 +1,349 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <deque>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "comm.h"
+
+
+// Returns the ENTITY_STATE_FIELD bits where b differs from a.
+inline unsigned char DiffEntityState(const EntityState& a,
+                                     const EntityState& b)
+{
+    unsigned char ret = 0;
+
+    if (a.loc != b.loc)
+        ret |= FIELD_LOC;
+    if (a.speed != b.speed)
+        ret |= FIELD_SPEED;
+    if (a.hp != b.hp)
+        ret |= FIELD_HP;
+    if (a.path != b.path)
+        ret |= FIELD_PATH;
+    if (a.name != b.name)
+        ret |= FIELD_NAME;
+    if (a.skin != b.skin)
+        ret |= FIELD_SKIN;
+
+    return ret;
+}
+
+
+// Copies the flagged fields from one state to another.
+inline void CopyEntityState(const EntityState& from, EntityState& to,
+                            unsigned char fields)
+{
+    if (fields & FIELD_LOC)
+        to.loc = from.loc;
+    if (fields & FIELD_SPEED)
+        to.speed = from.speed;
+    if (fields & FIELD_HP)
+        to.hp = from.hp;
+    if (fields & FIELD_PATH)
+        to.path = from.path;
+    if (fields & FIELD_NAME)
+        to.name = from.name;
+    if (fields & FIELD_SKIN)
+        to.skin = from.skin;
+}
+
+
+struct SnapshotStats
+{
+    unsigned long snapshots;
+    unsigned long deltas;
+    unsigned long full_states;
+};
+
+
+// Server half of snapshot replication, one per connected client. The owner
+// records the current state of each entity with Track() and calls Publish()
+// once per tick; only entities that differ from what the client has
+// acknowledged are sent, and only the fields that differ.
+//
+// Deltas travel on the reliable channel of every transport, so a state that
+// is already in flight is not repeated, and acks are cumulative. A client
+// that joins later simply gets its own SnapshotServer, whose first snapshot
+// carries every entity in full.
+class SnapshotServer
+{
+public:
+    SnapshotServer(Endpoint& endpoint)
+        : endpoint(endpoint),
+          sequence(0),
+          snapshots(0),
+          deltas(0),
+          full_states(0)
+    { }
+
+    // Sets the state the next Publish() replicates for entity_id.
+    void Track(unsigned int entity_id, const EntityState& state)
+    {
+        entities[entity_id].current = state;
+    }
+
+    // Stops replicating an entity. Telling the client it is gone (with an
+    // EntityDisappearMessage) is up to the caller.
+    void Forget(unsigned int entity_id)
+    {
+        entities.erase(entity_id);
+    }
+
+    // Sends one snapshot and returns its sequence number.
+    unsigned int Publish()
+    {
+        sequence++;
+        snapshots++;
+
+        for (auto& e : entities)
+        {
+            Tracked& t = e.second;
+
+            const EntityState* last = t.in_flight.empty() ?
+                (t.baseline_seq ? &t.baseline : NULL) :
+                &t.in_flight.back().second;
+
+            if (last && !DiffEntityState(*last, t.current))
+                continue;
+
+            EntityDeltaMessage* msg =
+                MessagePool<EntityDeltaMessage>::Acquire();
+
+            msg->entity_id = e.first;
+            msg->sequence = sequence;
+            msg->baseline = t.baseline_seq;
+            msg->fields = t.baseline_seq ?
+                DiffEntityState(t.baseline, t.current) :
+                (unsigned char)FIELD_ALL;
+
+            CopyEntityState(t.current, msg->state, msg->fields);
+
+            if (!t.baseline_seq)
+                full_states++;
+            deltas++;
+
+            t.in_flight.push_back(std::make_pair(sequence, t.current));
+            endpoint.Send(msg);
+        }
+
+        return sequence;
+    }
+
+    // Handles a SnapshotAckMessage from the client: every state sent up to
+    // sequence becomes the baseline for later deltas. A sequence of 0 means
+    // the client lost track and the next snapshot is sent in full.
+    void Acknowledge(unsigned int acked)
+    {
+        if (!acked)
+        {
+            Resync();
+            return;
+        }
+
+        for (auto& e : entities)
+        {
+            Tracked& t = e.second;
+
+            while (!t.in_flight.empty() && t.in_flight.front().first <= acked)
+            {
+                t.baseline_seq = t.in_flight.front().first;
+                t.baseline = std::move(t.in_flight.front().second);
+                t.in_flight.pop_front();
+            }
+        }
+    }
+
+    // Forgets every baseline, so the next snapshot is sent in full.
+    void Resync()
+    {
+        for (auto& e : entities)
+        {
+            e.second.baseline_seq = 0;
+            e.second.in_flight.clear();
+        }
+    }
+
+    inline unsigned int GetSequence() const { return sequence; }
+
+    SnapshotStats GetStats() const
+    {
+        SnapshotStats ret;
+        ret.snapshots = snapshots;
+        ret.deltas = deltas;
+        ret.full_states = full_states;
+        return ret;
+    }
+private:
+    struct Tracked
+    {
+        EntityState current;
+
+        // Last state the client acknowledged, or none if baseline_seq is 0.
+        EntityState baseline;
+        unsigned int baseline_seq = 0;
+
+        // States sent since then, oldest first.
+        std::deque<std::pair<unsigned int,EntityState> > in_flight;
+    };
+
+    Endpoint& endpoint;
+    std::unordered_map<unsigned int,Tracked> entities;
+
+    unsigned int sequence;
+
+    unsigned long snapshots;
+    unsigned long deltas;
+    unsigned long full_states;
+};
+
+
+// Client half of snapshot replication. Rebuilds full entity states from the
+// deltas and keeps, per entity, every state the server may still use as a
+// baseline.
+//
+// The server only moves a baseline forward, to the newest state it sent at
+// or before the latest ack it has seen. So once a delta against baseline B
+// arrives, the server has seen an ack of at least B, and for every entity
+// nothing older than its newest state at or before B is needed again.
+// History is trimmed to that each time an ack is taken.
+class SnapshotClient
+{
+public:
+    SnapshotClient()
+        : latest(0),
+          confirmed(0),
+          ack_due(false),
+          resync_due(false),
+          resyncing(false),
+          missed_baselines(0)
+    { }
+
+    // Applies a delta and returns the entity's resulting state, or NULL if
+    // the delta is relative to a state this side no longer has. In that case
+    // a resync is requested through the next ack. created is set when the
+    // entity was not known before.
+    const EntityState* Apply(const EntityDeltaMessage& delta, bool& created)
+    {
+        std::deque<Entry>& history = entities[delta.entity_id];
+        created = history.empty();
+
+        EntityState state;
+
+        if (delta.baseline)
+        {
+            while (!history.empty() &&
+                   history.front().sequence < delta.baseline)
+                history.pop_front();
+
+            if (history.empty() ||
+                history.front().sequence != delta.baseline)
+            {
+                if (created)
+                    entities.erase(delta.entity_id);
+
+                missed_baselines++;
+                RequestResync();
+                return NULL;
+            }
+
+            state = history.front().state;
+
+            if (delta.baseline > confirmed)
+                confirmed = delta.baseline;
+        }
+        else
+        {
+            // Older states stay: the server may not have seen the ack that
+            // makes one of them a baseline yet.
+            resyncing = false;
+        }
+
+        CopyEntityState(delta.state, state, delta.fields);
+
+        history.push_back(Entry());
+        history.back().sequence = delta.sequence;
+        history.back().state = std::move(state);
+
+        if (delta.sequence > latest)
+            latest = delta.sequence;
+        ack_due = true;
+
+        return &history.back().state;
+    }
+
+    void Forget(unsigned int entity_id)
+    {
+        entities.erase(entity_id);
+    }
+
+    // Returns true, with the sequence to acknowledge, if an ack should be
+    // sent. Meant to be called once per batch of applied deltas.
+    bool TakeAck(unsigned int& sequence)
+    {
+        if (resync_due)
+        {
+            resync_due = false;
+            ack_due = false;
+            sequence = 0;
+            return true;
+        }
+
+        if (!ack_due)
+            return false;
+
+        ack_due = false;
+        sequence = latest;
+
+        Trim();
+        return true;
+    }
+
+    inline unsigned long GetMissedBaselines() const
+    {
+        return missed_baselines;
+    }
+private:
+    struct Entry
+    {
+        unsigned int sequence;
+        EntityState state;
+    };
+
+    // Drops states older than the newest one at or before confirmed.
+    void Trim()
+    {
+        for (auto& e : entities)
+        {
+            std::deque<Entry>& history = e.second;
+
+            while (history.size() > 1 && history[1].sequence <= confirmed)
+                history.pop_front();
+        }
+    }
+
+    // One request is enough: deltas already in flight will miss too, until
+    // the first full state arrives.
+    void RequestResync()
+    {
+        if (resyncing)
+            return;
+
+        resyncing = true;
+        resync_due = true;
+    }
+
+    std::unordered_map<unsigned int,std::deque<Entry> > entities;
+
+    unsigned int latest;
+    unsigned int confirmed;
+    bool ack_due;
+    bool resync_due;
+    bool resyncing;
+
+    unsigned long missed_baselines;
+};
+
+#endif
@@ -0,0 +1,356 @@
+#ifndef SPATIAL_H
+#define SPATIAL_H
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "common.h"
+#include "slotmap.h"
+
+
+// Where things are on the tile map, for "what is near here" questions
+// without looking at everything. The map is cut into square cells of
+// 2^cell_shift tiles a side, and cells are hashed into a fixed number of
+// buckets, so the map has no bounds and empty space costs nothing. Each
+// thing is filed under a handle (GameEngine's, for entities); moving one
+// within a bucket is a store, and across buckets a swap-remove and an
+// append.
+class SpatialGrid
+{
+public:
+    enum { DEFAULT_CELL_SHIFT = 3, DEFAULT_BUCKETS = 4096 };
+
+    // buckets must be a power of two.
+    SpatialGrid(unsigned int cell_shift = DEFAULT_CELL_SHIFT,
+                size_t buckets = DEFAULT_BUCKETS)
+        : cell_shift(cell_shift),
+          mask(buckets - 1),
+          count(0)
+    {
+        if (!buckets || (buckets & (buckets - 1)))
+            throw std::runtime_error(
+                    "Spatial grid buckets must be a power of two.");
+
+        table.resize(buckets);
+    }
+
+    // Files handle at loc, or moves it there if it is already filed.
+    void Insert(SlotHandle handle, Point loc)
+    {
+        if (handle.IsNull())
+            return;
+
+        if (Move(handle, loc))
+            return;
+
+        if (handle.index >= where.size())
+            where.resize(handle.index + 1);
+
+        Add(handle, loc);
+        count++;
+    }
+
+    // False if handle is not filed.
+    bool Remove(SlotHandle handle)
+    {
+        if (!Contains(handle))
+            return false;
+
+        Take(handle.index);
+        where[handle.index].generation = 0;
+        count--;
+
+        return true;
+    }
+
+    // False if handle is not filed.
+    bool Move(SlotHandle handle, Point loc)
+    {
+        if (!Contains(handle))
+            return false;
+
+        Where& w = where[handle.index];
+        Entry& e = table[w.bucket][w.position];
+
+        if (Bucket(loc) == w.bucket)
+        {
+            e.loc = loc;
+            return true;
+        }
+
+        Take(handle.index);
+        Add(handle, loc);
+
+        return true;
+    }
+
+    inline bool Contains(SlotHandle handle) const
+    {
+        return handle.index < where.size() &&
+               where[handle.index].generation == handle.generation &&
+               !handle.IsNull();
+    }
+
+    // Only valid for a filed handle.
+    inline Point GetLoc(SlotHandle handle) const
+    {
+        const Where& w = where[handle.index];
+        return table[w.bucket][w.position].loc;
+    }
+
+    inline size_t Size() const { return count; }
+
+    // Appends everything from min to max, both included, to out.
+    void QueryRect(Point min, Point max, std::vector<SlotHandle>& out) const
+    {
+        Collect(min, max, NULL, 0, out);
+    }
+
+    // Appends everything no more than radius tiles (straight line) from
+    // center to out.
+    void QueryRadius(Point center, unsigned int radius,
+                     std::vector<SlotHandle>& out) const
+    {
+        Point min(center.x - (int)radius, center.y - (int)radius);
+        Point max(center.x + (int)radius, center.y + (int)radius);
+
+        Collect(min, max, &center, (long long)radius * radius, out);
+    }
+
+    // Appends the k things closest to center to out, closest first; fewer
+    // if there are not k. Searches outwards a ring of cells at a time and
+    // stops once no further cell can hold anything closer, falling back
+    // to looking at everything if the rings would cost more than that.
+    void QueryNearest(Point center, size_t k,
+                      std::vector<SlotHandle>& out) const
+    {
+        if (!k || !count)
+            return;
+
+        std::vector<Candidate> best;
+        best.reserve(std::min(k, count));
+
+        int cx = center.x >> cell_shift;
+        int cy = center.y >> cell_shift;
+        long long side = 1LL << cell_shift;
+        size_t seen = 0;
+
+        for (long long ring = 0; seen < count; ring++)
+        {
+            // Anything in this ring or beyond is at least this far off
+            // along one axis.
+            long long near = ring ? (ring - 1) * side + 1 : 0;
+
+            if (best.size() == k && near * near > best.front().distance)
+                break;
+
+            if ((2 * ring + 1) * (2 * ring + 1) > (long long)table.size())
+            {
+                best.clear();
+                Scan(center, k, best);
+                break;
+            }
+
+            for (long long y = cy - ring; y <= cy + ring; y++)
+            {
+                bool edge = (y == cy - ring || y == cy + ring);
+                long long step = edge ? 1 : 2 * ring;
+
+                for (long long x = cx - ring; x <= cx + ring; x += step)
+                    seen += Gather((int)x, (int)y, center, k, best);
+            }
+        }
+
+        std::sort_heap(best.begin(), best.end());
+
+        for (auto& c : best)
+            out.push_back(c.handle);
+    }
+private:
+    struct Entry
+    {
+        SlotHandle handle;
+        Point loc;
+    };
+
+    // Generation 0 when not filed.
+    struct Where
+    {
+        Where() : generation(0), bucket(0), position(0) { }
+
+        unsigned int generation;
+        unsigned int bucket;
+        unsigned int position;
+    };
+
+    // A max-heap on distance keeps the worst of the best k at the front.
+    struct Candidate
+    {
+        inline bool operator<(const Candidate& o) const
+        {
+            return distance < o.distance;
+        }
+
+        long long distance;
+        SlotHandle handle;
+    };
+
+    inline unsigned int Bucket(int cx, int cy) const
+    {
+        return ((unsigned int)cx * 73856093u ^
+                (unsigned int)cy * 19349663u) & mask;
+    }
+
+    inline unsigned int Bucket(Point loc) const
+    {
+        return Bucket(loc.x >> cell_shift, loc.y >> cell_shift);
+    }
+
+    static inline long long Distance(Point a, Point b)
+    {
+        long long dx = a.x - b.x;
+        long long dy = a.y - b.y;
+        return dx * dx + dy * dy;
+    }
+
+    void Add(SlotHandle handle, Point loc)
+    {
+        unsigned int bucket = Bucket(loc);
+
+        Where& w = where[handle.index];
+        w.generation = handle.generation;
+        w.bucket = bucket;
+        w.position = table[bucket].size();
+
+        Entry e;
+        e.handle = handle;
+        e.loc = loc;
+        table[bucket].push_back(e);
+    }
+
+    // Takes index out of its bucket, moving the bucket's last entry into
+    // the gap.
+    void Take(unsigned int index)
+    {
+        Where& w = where[index];
+        std::vector<Entry>& bucket = table[w.bucket];
+
+        if (w.position != bucket.size() - 1)
+        {
+            bucket[w.position] = bucket.back();
+            where[bucket[w.position].handle.index].position = w.position;
+        }
+
+        bucket.pop_back();
+    }
+
+    static void Offer(const Candidate& c, size_t k,
+                      std::vector<Candidate>& best)
+    {
+        if (best.size() < k)
+        {
+            best.push_back(c);
+            std::push_heap(best.begin(), best.end());
+        }
+        else if (c.distance < best.front().distance)
+        {
+            std::pop_heap(best.begin(), best.end());
+            best.back() = c;
+            std::push_heap(best.begin(), best.end());
+        }
+    }
+
+    // Offers everything in cell cx,cy; returns how many there were. Other
+    // cells that share the bucket are skipped, so each thing is seen once.
+    size_t Gather(int cx, int cy, Point center, size_t k,
+                  std::vector<Candidate>& best) const
+    {
+        size_t ret = 0;
+
+        for (auto& e : table[Bucket(cx, cy)])
+        {
+            if ((e.loc.x >> cell_shift) != cx ||
+                (e.loc.y >> cell_shift) != cy)
+                continue;
+
+            Candidate c;
+            c.distance = Distance(e.loc, center);
+            c.handle = e.handle;
+            Offer(c, k, best);
+            ret++;
+        }
+
+        return ret;
+    }
+
+    void Scan(Point center, size_t k, std::vector<Candidate>& best) const
+    {
+        for (auto& bucket : table)
+            for (auto& e : bucket)
+            {
+                Candidate c;
+                c.distance = Distance(e.loc, center);
+                c.handle = e.handle;
+                Offer(c, k, best);
+            }
+    }
+
+    // Appends everything from min to max, and within radius2 (squared) of
+    // center if there is one. Walks the cells the rectangle covers, or
+    // every bucket if that is fewer.
+    void Collect(Point min, Point max, const Point* center,
+                 long long radius2, std::vector<SlotHandle>& out) const
+    {
+        if (min.x > max.x || min.y > max.y)
+            return;
+
+        int cx0 = min.x >> cell_shift;
+        int cy0 = min.y >> cell_shift;
+        int cx1 = max.x >> cell_shift;
+        int cy1 = max.y >> cell_shift;
+
+        long long cells =
+            ((long long)cx1 - cx0 + 1) * ((long long)cy1 - cy0 + 1);
+
+        if (cells >= (long long)table.size())
+        {
+            for (auto& bucket : table)
+                for (auto& e : bucket)
+                    if (Within(e.loc, min, max, center, radius2))
+                        out.push_back(e.handle);
+
+            return;
+        }
+
+        for (int cy = cy0; cy <= cy1; cy++)
+            for (int cx = cx0; cx <= cx1; cx++)
+                for (auto& e : table[Bucket(cx, cy)])
+                {
+                    if ((e.loc.x >> cell_shift) != cx ||
+                        (e.loc.y >> cell_shift) != cy)
+                        continue;
+
+                    if (Within(e.loc, min, max, center, radius2))
+                        out.push_back(e.handle);
+                }
+    }
+
+    static inline bool Within(Point loc, Point min, Point max,
+                              const Point* center, long long radius2)
+    {
+        if (loc.x < min.x || loc.x > max.x || loc.y < min.y || loc.y > max.y)
+            return false;
+
+        return !center || Distance(loc, *center) <= radius2;
+    }
+
+    unsigned int cell_shift;
+    unsigned int mask;
+    size_t count;
+
+    std::vector<std::vector<Entry> > table;
+    std::vector<Where> where;
+};
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <vector>
+
+#include "slotmap.h"
+
+
+// Fires handles at a given time (in ms, like Time::GetNow), touching only
+// the ones that fire. Four levels of 64 slots each: level 0 holds the next
+// 64 ms one slot per ms, level 1 the next 4 s one slot per 64 ms, and so
+// on up to about four and a half hours; anything later waits in the top
+// level and is put back when its slot comes round. As time moves into a
+// slot of a higher level its timers are spread over the level below.
+//
+// Schedule and Cancel are O(1), and so is each ms that passes; stretches
+// with nothing to cascade or fire are skipped over, so catching up after a
+// long stall costs about the number of timers, not the length of it.
+class TimerWheel
+{
+public:
+    TimerWheel(unsigned int now = 0)
+        : current(now),
+          count(0)
+    {
+        for (unsigned int i = 0; i < LISTS; i++)
+            heads[i] = NONE;
+
+        for (unsigned int i = 0; i < LEVELS; i++)
+            level_counts[i] = 0;
+    }
+
+    // Fires handle at the first Advance to at or later; straight away if
+    // that has passed. Moves it if it is already scheduled.
+    void Schedule(SlotHandle handle, unsigned int at)
+    {
+        if (handle.IsNull())
+            return;
+
+        if (Contains(handle))
+            Unlink(handle.index);
+        else
+        {
+            if (handle.index >= nodes.size())
+                nodes.resize(handle.index + 1);
+
+            count++;
+        }
+
+        Node& n = nodes[handle.index];
+        n.generation = handle.generation;
+        n.at = at;
+
+        Link(handle.index);
+    }
+
+    // False if handle was not scheduled.
+    bool Cancel(SlotHandle handle)
+    {
+        if (!Contains(handle))
+            return false;
+
+        Unlink(handle.index);
+        nodes[handle.index].generation = 0;
+        count--;
+
+        return true;
+    }
+
+    inline bool Contains(SlotHandle handle) const
+    {
+        return handle.index < nodes.size() &&
+               nodes[handle.index].generation == handle.generation &&
+               !handle.IsNull();
+    }
+
+    inline size_t Size() const { return count; }
+
+    // Moves time on to now and appends whatever is due by then to fired,
+    // unscheduling it.
+    void Advance(unsigned int now, std::vector<SlotHandle>& fired)
+    {
+        Fire(DUE, fired);
+
+        while ((int)(now - current) > 0)
+        {
+            if (!count)
+            {
+                current = now;
+                break;
+            }
+
+            // Nothing happens before the next tick that cascades the
+            // lowest level with anything in it.
+            unsigned int span = 1;
+            for (unsigned int l = 0; l < LEVELS && !level_counts[l]; l++)
+                span <<= SLOT_BITS;
+
+            if (span > 1)
+            {
+                unsigned int next = (current | (span - 1)) + 1;
+
+                if ((int)(next - now) > 0)
+                {
+                    current = now;
+                    break;
+                }
+
+                current = next - 1;
+            }
+
+            current++;
+
+            // Cascade from the top, so nothing is put back into a slot
+            // already emptied this tick.
+            unsigned int levels = 1;
+            while (levels < LEVELS &&
+                   !((current >> ((levels - 1) * SLOT_BITS)) & SLOT_MASK))
+                levels++;
+
+            for (unsigned int l = levels - 1; l > 0; l--)
+                Cascade(l, (current >> (l * SLOT_BITS)) & SLOT_MASK);
+
+            Fire(current & SLOT_MASK, fired);
+            Fire(DUE, fired);
+        }
+    }
+private:
+    enum
+    {
+        LEVELS = 4,
+        SLOT_BITS = 6,
+        SLOTS = 1 << SLOT_BITS,
+        SLOT_MASK = SLOTS - 1,
+
+        // Lists: one per slot of each level, then the one due now.
+        DUE = LEVELS * SLOTS,
+        LISTS = DUE + 1,
+
+        NONE = 0xffffffff
+    };
+
+    // Generation 0 when not scheduled.
+    struct Node
+    {
+        Node() : generation(0), at(0), list(0), prev(NONE), next(NONE) { }
+
+        unsigned int generation;
+        unsigned int at;
+        unsigned int list;
+        unsigned int prev;
+        unsigned int next;
+    };
+
+    // Files index in the list for its time, as seen from current.
+    void Link(unsigned int index)
+    {
+        Node& n = nodes[index];
+        unsigned int delta = n.at - current;
+        unsigned int list = DUE;
+
+        if ((int)delta > 0)
+        {
+            unsigned int at = n.at;
+            unsigned int level = 0;
+
+            // Too far off for the top level: wait at its far end.
+            if (delta >> (LEVELS * SLOT_BITS))
+            {
+                at = current + (1u << (LEVELS * SLOT_BITS)) - 1;
+                level = LEVELS - 1;
+            }
+            else
+                while (delta >> ((level + 1) * SLOT_BITS))
+                    level++;
+
+            list = level * SLOTS + ((at >> (level * SLOT_BITS)) & SLOT_MASK);
+            level_counts[level]++;
+        }
+
+        n.list = list;
+        n.prev = NONE;
+        n.next = heads[list];
+
+        if (n.next != NONE)
+            nodes[n.next].prev = index;
+
+        heads[list] = index;
+    }
+
+    void Unlink(unsigned int index)
+    {
+        Node& n = nodes[index];
+
+        if (n.prev != NONE)
+            nodes[n.prev].next = n.next;
+        else
+            heads[n.list] = n.next;
+
+        if (n.next != NONE)
+            nodes[n.next].prev = n.prev;
+
+        if (n.list != DUE)
+            level_counts[n.list / SLOTS]--;
+    }
+
+    // Puts everything in a slot of a higher level back, now that it is
+    // near enough for a lower one.
+    void Cascade(unsigned int level, unsigned int slot)
+    {
+        unsigned int list = level * SLOTS + slot;
+        unsigned int index = heads[list];
+
+        heads[list] = NONE;
+
+        while (index != NONE)
+        {
+            unsigned int next = nodes[index].next;
+            level_counts[level]--;
+            Link(index);
+            index = next;
+        }
+    }
+
+    void Fire(unsigned int list, std::vector<SlotHandle>& fired)
+    {
+        unsigned int index = heads[list];
+
+        heads[list] = NONE;
+
+        while (index != NONE)
+        {
+            Node& n = nodes[index];
+
+            if (list != DUE)
+                level_counts[0]--;
+
+            fired.push_back(SlotHandle(index, n.generation));
+            n.generation = 0;
+            count--;
+
+            index = n.next;
+        }
+    }
+
+    unsigned int current;
+    size_t count;
+
+    unsigned int heads[LISTS];
+    unsigned int level_counts[LEVELS];
+    std::vector<Node> nodes;
+};
+
+#endif
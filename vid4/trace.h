@@ -0,0 +1,198 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <ostream>
+#include <vector>
+
+#include "common.h"
+#include "comm.h"
+
+
+// Counts of values (microseconds) in logarithmic buckets: 16 per power of
+// two, so any percentile read back is within about 6% of the real value.
+// Fixed size, no allocation when recording.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram()
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        for (auto& b : buckets)
+            b = 0;
+
+        count = 0;
+        max = 0;
+    }
+
+    inline void Record(unsigned long long value)
+    {
+        buckets[BucketOf(value)]++;
+        count++;
+
+        if (value > max)
+            max = value;
+    }
+
+    // Smallest value v such that at least fraction of the recorded values
+    // are <= v, rounded down to its bucket.
+    unsigned long long GetPercentile(double fraction) const
+    {
+        if (!count)
+            return 0;
+
+        unsigned long long rank = (unsigned long long)(fraction * count);
+        if (rank >= count)
+            rank = count - 1;
+
+        unsigned long long seen = 0;
+
+        for (unsigned int i = 0; i < BUCKET_COUNT; i++)
+        {
+            seen += buckets[i];
+
+            if (seen > rank)
+                return std::min(LowestOf(i), max);
+        }
+
+        return max;
+    }
+
+    inline unsigned long long GetCount() const { return count; }
+    inline unsigned long long GetMax() const { return max; }
+private:
+    enum { SUB_BITS = 4, SUB_COUNT = 1 << SUB_BITS, BUCKET_COUNT = 64 * 16 };
+
+    static inline unsigned int BucketOf(unsigned long long value)
+    {
+        if (value < SUB_COUNT)
+            return value;
+
+        unsigned int exponent = 63 - __builtin_clzll(value);
+        unsigned int sub = (value >> (exponent - SUB_BITS)) & (SUB_COUNT - 1);
+
+        return (exponent - SUB_BITS + 1) * SUB_COUNT + sub;
+    }
+
+    static inline unsigned long long LowestOf(unsigned int bucket)
+    {
+        if (bucket < SUB_COUNT)
+            return bucket;
+
+        unsigned int exponent = bucket / SUB_COUNT + SUB_BITS - 1;
+        unsigned long long sub = bucket % SUB_COUNT;
+
+        return (SUB_COUNT + sub) << (exponent - SUB_BITS);
+    }
+
+    unsigned long long buckets[BUCKET_COUNT];
+    unsigned long long count;
+    unsigned long long max;
+};
+
+
+// Latency of messages from creation to the screen, per message type, split
+// into the stages between the points messages are stamped at:
+//
+//   queued    created -> Router::Dispatch picked it up
+//   routed    dispatched -> ClientComm handled it
+//   shown     handled -> end of the next GraphicsEngine::Draw
+//   total     created -> end of that Draw
+//
+// A message is created when it is taken from its MessagePool, which for
+// messages that came in over a transport means when they were decoded, so
+// network time is not included.
+class LatencyTracer
+{
+public:
+    enum STAGE { STAGE_QUEUED, STAGE_ROUTED, STAGE_SHOWN, STAGE_TOTAL,
+                 STAGE_COUNT };
+
+    // Call as a message is handled, while it is still alive. The message
+    // may be shared, so the handled time is kept here rather than on it.
+    void OnHandled(const Message& msg)
+    {
+        unsigned long long now = Time::GetMicros();
+
+        Pending p;
+        p.type = msg.GetType();
+        p.created = msg.GetStamp(TRACE_CREATED);
+        p.dispatched = msg.GetStamp(TRACE_DISPATCHED);
+        p.handled = now;
+        pending.push_back(p);
+    }
+
+    // Call once a frame has been drawn. Everything handled since the last
+    // frame is on screen now.
+    void OnFrame()
+    {
+        if (pending.empty())
+            return;
+
+        unsigned long long now = Time::GetMicros();
+
+        for (auto& p : pending)
+        {
+            LatencyHistogram* h = histograms[p.type];
+
+            // Messages that never went through a router have no dispatch
+            // stamp; count their wait as queueing.
+            unsigned long long dispatched =
+                p.dispatched ? p.dispatched : p.handled;
+
+            h[STAGE_QUEUED].Record(dispatched - p.created);
+            h[STAGE_ROUTED].Record(p.handled - dispatched);
+            h[STAGE_SHOWN].Record(now - p.handled);
+            h[STAGE_TOTAL].Record(now - p.created);
+        }
+
+        pending.clear();
+    }
+
+    inline LatencyHistogram const& GetHistogram(int type, int stage) const
+    {
+        return histograms[type][stage];
+    }
+
+    // One line per message type and stage, in microseconds.
+    void Report(std::ostream& out) const
+    {
+        static const char* stage_names[STAGE_COUNT] = {
+            "queued", "routed", "shown", "total"
+        };
+
+        out << "type stage count p50 p99 max (us)" << std::endl;
+
+        for (int type = 0; type < MSG_TYPE_COUNT; type++)
+            for (int stage = 0; stage < STAGE_COUNT; stage++)
+            {
+                const LatencyHistogram& h = histograms[type][stage];
+
+                if (!h.GetCount())
+                    continue;
+
+                out << type << " " << stage_names[stage] << " " <<
+                    h.GetCount() << " " <<
+                    h.GetPercentile(0.5) << " " <<
+                    h.GetPercentile(0.99) << " " <<
+                    h.GetMax() << std::endl;
+            }
+    }
+private:
+    struct Pending
+    {
+        unsigned char type;
+        unsigned long long created;
+        unsigned long long dispatched;
+        unsigned long long handled;
+    };
+
+    std::vector<Pending> pending;
+    LatencyHistogram histograms[MSG_TYPE_COUNT][STAGE_COUNT];
+};
+
+#endif
@@ -0,0 +1,695 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <map>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <unordered_map>
+
+#include "net.h"
+
+
+// Artificial impairment applied to every datagram a UdpTransport sends, so
+// loss and latency can be reproduced on one machine.
+struct LinkConditions
+{
+    LinkConditions(double loss = 0.0,
+                   unsigned int latency_ms = 0,
+                   unsigned int jitter_ms = 0)
+        : loss(loss),
+          latency_ms(latency_ms),
+          jitter_ms(jitter_ms)
+    { }
+
+    double loss;
+    unsigned int latency_ms;
+    unsigned int jitter_ms;
+};
+
+
+struct UdpStats
+{
+    unsigned long reliable_sent;
+    unsigned long reliable_resent;
+    unsigned long reliable_delivered;
+    unsigned long unreliable_sent;
+    unsigned long unreliable_delivered;
+    unsigned long stale_dropped;
+    unsigned long oversized;
+    unsigned long injected_losses;
+    unsigned long malformed;
+    unsigned int rtt_ms;
+};
+
+
+// Carries an Endpoint over UDP with two channels.
+//
+// Reliable: every message gets a sequence number and is resent until
+// acknowledged. The receiver delivers strictly in order, holding anything
+// that arrives early. Every datagram acks the next sequence it expects plus
+// a bitmask of the 32 after that, so a single lost datagram only costs a
+// resend of what it carried.
+//
+// Unreliable: movement, which is superseded by the next update anyway. It
+// is never resent, never waits behind the reliable channel, and anything
+// older than what was already delivered for the same entity is dropped.
+// A move only goes this way once everything sent reliably about its entity
+// has been acknowledged; until then it is sent reliably too, so it cannot
+// arrive ahead of the appear it depends on.
+//
+// A message that would not fit in one datagram on its own is dropped when
+// it is collected and counted as oversized.
+//
+// Datagram layout:
+//   uint ack, u32 ack_bits, (u8 channel, uint seq, uint length, message)*
+class UdpTransport
+{
+public:
+    UdpTransport(Endpoint& endpoint,
+                 const boost::asio::ip::udp::endpoint& local,
+                 const LinkConditions& conditions = LinkConditions())
+        : endpoint(endpoint),
+          socket(io, local),
+          tick_timer(io),
+          conditions(conditions),
+          random(std::random_device()()),
+          has_peer(false),
+          established(false),
+          last_announce(0),
+          next_reliable(0),
+          next_unreliable(0),
+          acked_base(0),
+          recv_next(0),
+          ack_pending(true),
+          srtt(INITIAL_RTO_MS / 2),
+          rto(INITIAL_RTO_MS),
+          last_backoff(0)
+    {
+        stats = UdpStats();
+    }
+
+    virtual ~UdpTransport()
+    {
+        Stop();
+
+        for (auto& m : reordered)
+            m.second->Release();
+    }
+
+    void Stop()
+    {
+        io.stop();
+
+        if (thread.joinable())
+            thread.join();
+
+        boost::system::error_code ignored;
+        socket.close(ignored);
+    }
+
+    inline unsigned short GetPort() const
+    {
+        return socket.local_endpoint().port();
+    }
+
+    UdpStats GetStats() const
+    {
+        boost::mutex::scoped_lock lock(stats_mutex);
+        return stats;
+    }
+protected:
+    void SetPeer(const boost::asio::ip::udp::endpoint& peer)
+    {
+        this->peer = peer;
+        has_peer = true;
+    }
+
+    void Start()
+    {
+        StartReceive();
+        StartTick();
+
+        thread = boost::thread(
+            boost::bind(&boost::asio::io_service::run, &io));
+    }
+
+    boost::asio::io_service io;
+private:
+    enum
+    {
+        MTU = 1200,
+        TICK_MS = 1,
+        WINDOW = 1024,
+        INITIAL_RTO_MS = 100,
+        MIN_RTO_MS = 20,
+        MAX_RTO_MS = 1000
+    };
+
+    enum CHANNEL { CHANNEL_RELIABLE, CHANNEL_UNRELIABLE };
+
+    // Room for an entry's message once the datagram header (ack, ack bits)
+    // and the entry header (channel, seq, length) are in.
+    enum { MAX_ENTRY = MTU - 9 - 11 };
+
+    struct Outgoing
+    {
+        std::vector<unsigned char> bytes;
+        unsigned int last_sent;
+        unsigned int sends;
+    };
+
+    struct Delayed
+    {
+        unsigned int due;
+        std::vector<unsigned char> bytes;
+
+        bool operator<(const Delayed& other) const
+        {
+            return due > other.due;
+        }
+    };
+
+    static unsigned int NowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool IsUnreliable(Message* message)
+    {
+        return message->GetType() == MSG_ENTITY_MOVE;
+    }
+
+    // Whether message can go unreliably now, see the class comment. Keeps
+    // track of the last reliable message about each entity as it goes.
+    bool CanSendUnreliably(Message* message, unsigned int seq)
+    {
+        if (message->GetType() == MSG_SNAPSHOT_ACK)
+            return false;
+
+        unsigned int id = static_cast<EntityMessage*>(message)->entity_id;
+        auto it = unacked_entities.find(id);
+
+        if (IsUnreliable(message))
+        {
+            if (it == unacked_entities.end())
+                return true;
+
+            if (it->second < acked_base)
+            {
+                unacked_entities.erase(it);
+                return true;
+            }
+        }
+
+        // Nothing sent after a disappear can depend on it except a new
+        // appear, which records itself again.
+        if (message->GetType() == MSG_ENTITY_DISAPPEAR)
+        {
+            if (it != unacked_entities.end())
+                unacked_entities.erase(it);
+        }
+        else
+        {
+            unacked_entities[id] = seq;
+        }
+
+        return false;
+    }
+
+    void StartTick()
+    {
+        tick_timer.expires_from_now(
+            boost::asio::chrono::milliseconds(TICK_MS));
+
+        tick_timer.async_wait(
+            boost::bind(&UdpTransport::OnTick, this,
+                        boost::asio::placeholders::error));
+    }
+
+    void OnTick(const boost::system::error_code& error)
+    {
+        if (error)
+            return;
+
+        unsigned int now = NowMs();
+
+        Collect();
+
+        if (has_peer)
+            SendDatagrams(now);
+
+        ReleaseDelayed(now);
+        StartTick();
+    }
+
+    // Pulls everything waiting at the endpoint and files it by channel.
+    void Collect()
+    {
+        outbox.clear();
+        endpoint.PollAll(outbox);
+
+        for (auto& m : outbox)
+        {
+            scratch.clear();
+            MessageCodec::Encode(*m, scratch);
+
+            if (scratch.size() > MAX_ENTRY)
+            {
+                boost::mutex::scoped_lock lock(stats_mutex);
+                stats.oversized++;
+            }
+            else if (CanSendUnreliably(m, next_reliable))
+            {
+                // Without a peer there is nobody to send movement to, and by
+                // the time there is it will be stale.
+                if (has_peer)
+                    unreliable_out.push_back(scratch);
+            }
+            else
+            {
+                Outgoing& o = unacked[next_reliable++];
+                o.bytes = scratch;
+                o.last_sent = 0;
+                o.sends = 0;
+            }
+
+            m->Release();
+        }
+    }
+
+    void SendDatagrams(unsigned int now)
+    {
+        bool resent = false;
+
+        BeginDatagram();
+
+        for (auto& u : unacked)
+        {
+            if (u.first >= acked_base + WINDOW)
+                break;
+
+            Outgoing& o = u.second;
+
+            if (o.sends > 0 && now - o.last_sent < rto)
+                continue;
+
+            AddEntry(CHANNEL_RELIABLE, u.first, o.bytes);
+
+            resent |= o.sends > 0;
+            o.last_sent = now;
+            o.sends++;
+
+            boost::mutex::scoped_lock lock(stats_mutex);
+            if (o.sends > 1)
+                stats.reliable_resent++;
+            else
+                stats.reliable_sent++;
+        }
+
+        // Back off (once per timeout period) while timeouts keep firing;
+        // resent messages give no RTT samples, so the estimate could not
+        // recover otherwise.
+        if (resent && now - last_backoff >= rto)
+        {
+            rto = std::min((unsigned int)MAX_RTO_MS, rto * 2);
+            last_backoff = now;
+        }
+
+        for (auto& bytes : unreliable_out)
+        {
+            AddEntry(CHANNEL_UNRELIABLE, next_unreliable++, bytes);
+
+            boost::mutex::scoped_lock lock(stats_mutex);
+            stats.unreliable_sent++;
+        }
+        unreliable_out.clear();
+
+        // Until the peer has answered, keep announcing ourselves in case
+        // the first datagram was lost.
+        bool announce = !established && now - last_announce >= MIN_RTO_MS;
+
+        if (datagram_entries > 0 || ack_pending || announce)
+        {
+            EndDatagram();
+            last_announce = now;
+        }
+    }
+
+    void BeginDatagram()
+    {
+        datagram.clear();
+        datagram_entries = 0;
+
+        WireWriter w(datagram);
+        w.PutVarint(recv_next);
+
+        unsigned int bits = 0;
+        for (auto it = reordered.upper_bound(recv_next);
+             it != reordered.end() && it->first - recv_next <= 32;
+             ++it)
+            bits |= 1u << (it->first - recv_next - 1);
+
+        for (unsigned int i = 0; i < 4; i++)
+            w.PutByte((bits >> (i * 8)) & 0xff);
+    }
+
+    void AddEntry(unsigned char channel, unsigned int seq,
+                  const std::vector<unsigned char>& bytes)
+    {
+        if (datagram_entries > 0 &&
+            datagram.size() + bytes.size() + 11 > MTU)
+        {
+            EndDatagram();
+            BeginDatagram();
+        }
+
+        WireWriter w(datagram);
+        w.PutByte(channel);
+        w.PutVarint(seq);
+        w.PutVarint(bytes.size());
+        datagram.insert(datagram.end(), bytes.begin(), bytes.end());
+        datagram_entries++;
+    }
+
+    void EndDatagram()
+    {
+        Transmit(datagram);
+        ack_pending = false;
+    }
+
+    // The loss/latency shim sits here, in front of the socket.
+    void Transmit(const std::vector<unsigned char>& bytes)
+    {
+        if (conditions.loss > 0.0 &&
+            std::uniform_real_distribution<double>(0.0, 1.0)(random) <
+                conditions.loss)
+        {
+            boost::mutex::scoped_lock lock(stats_mutex);
+            stats.injected_losses++;
+            return;
+        }
+
+        if (conditions.latency_ms == 0 && conditions.jitter_ms == 0)
+        {
+            SendNow(bytes);
+            return;
+        }
+
+        Delayed d;
+        d.due = NowMs() + conditions.latency_ms;
+        if (conditions.jitter_ms > 0)
+            d.due += std::uniform_int_distribution<unsigned int>(
+                0, conditions.jitter_ms)(random);
+        d.bytes = bytes;
+        delayed.push(d);
+    }
+
+    void ReleaseDelayed(unsigned int now)
+    {
+        while (!delayed.empty() && (int)(now - delayed.top().due) >= 0)
+        {
+            SendNow(delayed.top().bytes);
+            delayed.pop();
+        }
+    }
+
+    void SendNow(const std::vector<unsigned char>& bytes)
+    {
+        boost::system::error_code ignored;
+        socket.send_to(boost::asio::buffer(bytes), peer, 0, ignored);
+    }
+
+    void StartReceive()
+    {
+        socket.async_receive_from(
+            boost::asio::buffer(receive_buffer, sizeof(receive_buffer)),
+            sender,
+            boost::bind(&UdpTransport::OnReceive, this,
+                        boost::asio::placeholders::error,
+                        boost::asio::placeholders::bytes_transferred));
+    }
+
+    void OnReceive(const boost::system::error_code& error, size_t bytes)
+    {
+        if (error == boost::asio::error::operation_aborted)
+            return;
+
+        if (!error)
+        {
+            // A server learns where its client is from the first datagram.
+            if (!has_peer)
+                SetPeer(sender);
+
+            if (sender == peer)
+            {
+                established = true;
+                inbox.clear();
+
+                try
+                {
+                    Parse(receive_buffer, bytes);
+                }
+                catch (std::runtime_error&)
+                {
+                    boost::mutex::scoped_lock lock(stats_mutex);
+                    stats.malformed++;
+                }
+
+                // Whatever was decoded before a bad entry is still good.
+                endpoint.SendAll(inbox);
+            }
+        }
+
+        StartReceive();
+    }
+
+    void Parse(const unsigned char* data, size_t size)
+    {
+        WireReader r(data, size);
+
+        unsigned int ack = r.GetVarint();
+        unsigned int bits = 0;
+        for (unsigned int i = 0; i < 4; i++)
+            bits |= (unsigned int)r.GetByte() << (i * 8);
+
+        ProcessAcks(ack, bits);
+
+        while (r.GetRemaining() > 0)
+        {
+            unsigned char channel = r.GetByte();
+            unsigned int seq = r.GetVarint();
+            unsigned int length = r.GetVarint();
+
+            const unsigned char* body = data + r.GetConsumed();
+            r.Skip(length);
+
+            if (channel == CHANNEL_RELIABLE)
+                ReceiveReliable(seq, body, length);
+            else
+                ReceiveUnreliable(seq, body, length);
+        }
+    }
+
+    void ProcessAcks(unsigned int ack, unsigned int bits)
+    {
+        unsigned int now = NowMs();
+
+        while (!unacked.empty() && unacked.begin()->first < ack)
+        {
+            Acked(unacked.begin()->second, now);
+            unacked.erase(unacked.begin());
+        }
+
+        for (unsigned int i = 0; bits; i++, bits >>= 1)
+        {
+            if (!(bits & 1))
+                continue;
+
+            auto it = unacked.find(ack + 1 + i);
+            if (it == unacked.end())
+                continue;
+
+            Acked(it->second, now);
+            unacked.erase(it);
+        }
+
+        if (ack > acked_base)
+            acked_base = ack;
+    }
+
+    // Only messages that were sent once give an unambiguous RTT sample.
+    void Acked(const Outgoing& o, unsigned int now)
+    {
+        if (o.sends != 1)
+            return;
+
+        unsigned int sample = now - o.last_sent;
+        srtt = (srtt * 7 + sample) / 8;
+        rto = std::max((unsigned int)MIN_RTO_MS,
+                       std::min((unsigned int)MAX_RTO_MS, srtt * 2 + 5));
+
+        boost::mutex::scoped_lock lock(stats_mutex);
+        stats.rtt_ms = srtt;
+    }
+
+    void ReceiveReliable(unsigned int seq, const unsigned char* body,
+                         unsigned int length)
+    {
+        ack_pending = true;
+
+        if (seq < recv_next || seq >= recv_next + WINDOW ||
+            reordered.count(seq))
+            return;
+
+        size_t used;
+        Message* m = MessageCodec::Decode(body, length, used);
+
+        if (seq != recv_next)
+        {
+            reordered[seq] = m;
+            return;
+        }
+
+        inbox.push_back(m);
+        recv_next++;
+
+        while (!reordered.empty() && reordered.begin()->first == recv_next)
+        {
+            inbox.push_back(reordered.begin()->second);
+            reordered.erase(reordered.begin());
+            recv_next++;
+        }
+
+        boost::mutex::scoped_lock lock(stats_mutex);
+        stats.reliable_delivered = recv_next;
+    }
+
+    void ReceiveUnreliable(unsigned int seq, const unsigned char* body,
+                           unsigned int length)
+    {
+        size_t used;
+        Message* m = MessageCodec::Decode(body, length, used);
+
+        // Only what IsUnreliable picks is ever sent this way; anything
+        // else drops the datagram like any other bad entry.
+        if (!IsUnreliable(m))
+        {
+            m->Release();
+            throw std::runtime_error(
+                    "Unreliable entry is not an entity move.");
+        }
+
+        unsigned int entity_id = static_cast<EntityMessage*>(m)->entity_id;
+
+        auto it = latest_unreliable.find(entity_id);
+
+        if (it != latest_unreliable.end() && seq <= it->second)
+        {
+            m->Release();
+
+            boost::mutex::scoped_lock lock(stats_mutex);
+            stats.stale_dropped++;
+            return;
+        }
+
+        latest_unreliable[entity_id] = seq;
+        inbox.push_back(m);
+
+        boost::mutex::scoped_lock lock(stats_mutex);
+        stats.unreliable_delivered++;
+    }
+
+    Endpoint& endpoint;
+
+    boost::asio::ip::udp::socket socket;
+    boost::asio::steady_timer tick_timer;
+    boost::thread thread;
+
+    LinkConditions conditions;
+    std::mt19937 random;
+    std::priority_queue<Delayed> delayed;
+
+    boost::asio::ip::udp::endpoint peer;
+    boost::asio::ip::udp::endpoint sender;
+    bool has_peer;
+    bool established;
+    unsigned int last_announce;
+
+    // Sending side
+    unsigned int next_reliable;
+    unsigned int next_unreliable;
+    unsigned int acked_base;
+    std::map<unsigned int,Outgoing> unacked;
+    std::vector<std::vector<unsigned char> > unreliable_out;
+    std::unordered_map<unsigned int,unsigned int> unacked_entities;
+    std::vector<unsigned char> scratch;
+    std::vector<unsigned char> datagram;
+    unsigned int datagram_entries;
+
+    // Receiving side
+    unsigned int recv_next;
+    bool ack_pending;
+    std::map<unsigned int,Message*> reordered;
+    std::unordered_map<unsigned int,unsigned int> latest_unreliable;
+
+    unsigned int srtt;
+    unsigned int rto;
+    unsigned int last_backoff;
+
+    unsigned char receive_buffer[64 * 1024];
+    std::vector<Message*> inbox;
+    std::vector<Message*> outbox;
+
+    mutable boost::mutex stats_mutex;
+    UdpStats stats;
+};
+
+
+// Connects the endpoint returned by Router::Register(ADDR_UPLINK) to a
+// server over UDP.
+class UdpUplink : public UdpTransport
+{
+public:
+    UdpUplink(Endpoint& uplink, const std::string& host,
+              unsigned short port,
+              const LinkConditions& conditions = LinkConditions())
+        : UdpTransport(uplink,
+                       boost::asio::ip::udp::endpoint(
+                           boost::asio::ip::udp::v4(), 0),
+                       conditions)
+    {
+        boost::asio::ip::udp::resolver resolver(io);
+        boost::asio::ip::udp::resolver::query query(
+            boost::asio::ip::udp::v4(), host, std::to_string(port));
+
+        SetPeer(*resolver.resolve(query));
+        Start();
+    }
+};
+
+
+// UDP counterpart of LoopbackServer. The peer is whoever sends the first
+// datagram; UdpUplink announces itself with an empty ack on its first tick.
+class UdpLoopbackServer : private EndpointPair, public UdpTransport
+{
+public:
+    UdpLoopbackServer(const LinkConditions& conditions = LinkConditions())
+        : UdpTransport(GetTransportEndpoint(),
+                       boost::asio::ip::udp::endpoint(
+                           boost::asio::ip::address_v4::loopback(), 0),
+                       conditions)
+    {
+        Start();
+    }
+
+    virtual ~UdpLoopbackServer()
+    {
+        Stop();
+    }
+
+    using EndpointPair::GetScriptEndpoint;
+};
+
+#endif